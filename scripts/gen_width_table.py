@@ -0,0 +1,85 @@
+#!/usr/bin/env python3
+"""Generates src/width_table.c, the two-stage display width table.
+
+Usage: scripts/gen_width_table.py > src/width_table.c  (or `make width-table`)
+
+Width classes come from the East_Asian_Width property and the general
+category in Python's unicodedata, so the Unicode version follows the Python
+used to run this script. Every code point gets a 2-bit class:
+
+  0 zero      nonspacing/enclosing marks, format characters, Hangul medial
+              vowels and final consonants; drawn on the preceding cell
+  1 narrow    one column
+  2 wide      East_Asian_Width W or F, plus unassigned ideographic ranges
+  3 ambiguous East_Asian_Width A; one column unless ambiguous-width = 2
+
+Stage 1 maps each 256-code-point block to a deduplicated stage 2 block of
+64 bytes (four classes per byte).
+"""
+
+import sys
+import unicodedata
+
+BLOCK = 256
+ZERO, NARROW, WIDE, AMBIGUOUS = range(4)
+
+
+def width_class(cp):
+    c = chr(cp)
+    cat = unicodedata.category(c)
+    if cp == 0x00AD:
+        return NARROW  # soft hyphen is conventionally given a column
+    if cat in ("Mn", "Me", "Cf") or 0x1160 <= cp <= 0x11FF or cp == 0x200B:
+        return ZERO
+    if cat == "Cn":
+        # unicodedata reports F for some unassigned code points; use the
+        # defaults from EastAsianWidth.txt instead
+        reserved_wide = ((0x3400, 0x4DBF), (0x4E00, 0x9FFF), (0xF900, 0xFAFF),
+                         (0x20000, 0x2FFFD), (0x30000, 0x3FFFD))
+        if any(lo <= cp <= hi for lo, hi in reserved_wide):
+            return WIDE
+        return NARROW
+    eaw = unicodedata.east_asian_width(c)
+    if eaw in ("W", "F"):
+        return WIDE
+    if eaw == "A":
+        return AMBIGUOUS
+    return NARROW
+
+
+def main():
+    blocks = []
+    index = {}
+    stage1 = []
+    for base in range(0, 0x110000, BLOCK):
+        packed = bytearray(BLOCK // 4)
+        for i in range(BLOCK):
+            packed[i // 4] |= width_class(base + i) << ((i % 4) * 2)
+        key = bytes(packed)
+        if key not in index:
+            index[key] = len(blocks)
+            blocks.append(key)
+        stage1.append(index[key])
+    if len(blocks) > 256:
+        sys.exit("width table: too many distinct blocks for a uint8_t index")
+
+    out = sys.stdout
+    out.write("// Generated by scripts/gen_width_table.py from Unicode %s; do not "
+              "edit.\n\n" % unicodedata.unidata_version)
+    out.write('#include "width_table.h"\n\n')
+    out.write("const uint8_t width_stage1[%d] = {\n" % len(stage1))
+    for i in range(0, len(stage1), 16):
+        out.write("    " + ", ".join("%d" % v for v in stage1[i:i + 16]) + ",\n")
+    out.write("};\n\n")
+    out.write("const uint8_t width_stage2[%d][%d] = {\n" % (len(blocks), BLOCK // 4))
+    for block in blocks:
+        out.write("    {\n")
+        for i in range(0, len(block), 12):
+            out.write("        " +
+                      ", ".join("0x%02x" % v for v in block[i:i + 12]) + ",\n")
+        out.write("    },\n")
+    out.write("};\n")
+
+
+if __name__ == "__main__":
+    main()
@@ -3,6 +3,7 @@
 #include <string.h>
 
 #include "args.h"
+#include "terminal.h"
 
 static void strip(char *s) {
   int len = strlen(s);
@@ -84,6 +85,41 @@ static void load_config(Args *args) {
     } else if (strcmp(key, "title") == 0) {
       free(args->title);
       args->title = strdup(val);
+    } else if (strcmp(key, "osc-max-bytes") == 0) {
+      int v = atoi(val);
+      if (v > 0)
+        args->osc_max_bytes = v;
+    } else if (strcmp(key, "ambiguous-width") == 0) {
+      int v = atoi(val);
+      if (v == 1 || v == 2)
+        args->ambiguous_width = v;
+    } else if (strcmp(key, "scrollback-compress") == 0) {
+      int v = atoi(val);
+      if (v >= 0)
+        args->scrollback_compress = v;
+    } else if (strcmp(key, "scrollback-file-mb") == 0) {
+      int v = atoi(val);
+      if (v >= 0)
+        args->scrollback_file_mb = v;
+    } else if (strcmp(key, "scrollback-max-bytes") == 0) {
+      long v = atol(val);
+      if (v > 0 && v < SCROLLBACK_MIN_BUDGET)
+        fprintf(stderr, "Warning: ignoring scrollback-max-bytes below %d\n",
+                SCROLLBACK_MIN_BUDGET);
+      else if (v >= 0)
+        args->scrollback_max_bytes = v;
+    } else if (strcmp(key, "max-fps") == 0) {
+      int v = atoi(val);
+      if (v >= 0)
+        args->max_fps = v;
+    } else if (strcmp(key, "read-slice-ms") == 0) {
+      int v = atoi(val);
+      if (v > 0)
+        args->read_slice_ms = v;
+    } else if (strcmp(key, "read-slice-kb") == 0) {
+      int v = atoi(val);
+      if (v > 0)
+        args->read_slice_kb = v;
     }
   }
   fclose(f);
@@ -95,6 +131,13 @@ void print_usage(const char *program_name) {
   fprintf(stderr, "  --font-size SIZE      Set font size (default: 14)\n");
   fprintf(stderr,
           "  --scrollback N        Scrollback buffer size (default: 1000)\n");
+  fprintf(stderr, "  --scrollback-compress N  Compress scrollback older than N "
+                  "lines, 0 = never (default: 5000)\n");
+  fprintf(stderr, "  --scrollback-file-mb N  Spill lines evicted from the "
+                  "scrollback to a file of up to N MB (default: 0, off)\n");
+  fprintf(stderr, "  --scrollback-max-bytes N  Memory budget for scrollback "
+                  "blocks in bytes, at least 131072; the line index and "
+                  "read cache are extra (default: 0, no limit)\n");
   fprintf(
       stderr,
       "  --font PATTERN        Fontconfig font pattern (e.g. 'Monospace')\n");
@@ -115,12 +158,28 @@ void print_usage(const char *program_name) {
           "  --title TEXT          Initial window title\n");
   fprintf(stderr,
           "  --size COLSxROWS      Initial window size in character cells (e.g. 220x50)\n");
+  fprintf(stderr, "  --osc-max-bytes N     Longest OSC/escape sequence accepted "
+                  "(default: 8388608)\n");
+  fprintf(stderr, "  --ambiguous-width N   Columns for East Asian ambiguous "
+                  "characters, 1 or 2 (default: 1)\n");
+  fprintf(stderr, "  --max-fps N           Frames drawn per second while output "
+                  "streams, 0 = monitor refresh rate (default: 0)\n");
+  fprintf(stderr, "  --read-slice-ms N     Longest time spent reading shell "
+                  "output before handling input (default: 2)\n");
+  fprintf(stderr, "  --read-slice-kb N     Most shell output read before "
+                  "handling input (default: 1024)\n");
   fprintf(stderr, "  --help                Show this help message\n");
 }
 
 void parse_args(int argc, char *argv[], Args *args) {
   args->font_size = 14;
   args->scrollback = 1000;
+  args->scrollback_compress = 5000;
+  args->scrollback_file_mb = 0;
+  args->scrollback_max_bytes = 0;
+  args->max_fps = 0;
+  args->read_slice_ms = 2;
+  args->read_slice_kb = 1024;
   args->log_file = NULL;
   args->font = NULL;
   args->fg = -1;
@@ -130,6 +189,8 @@ void parse_args(int argc, char *argv[], Args *args) {
   args->cols = 0;
   args->rows = 0;
   args->title = NULL;
+  args->osc_max_bytes = 8 * 1024 * 1024;
+  args->ambiguous_width = 1;
   for (int i = 0; i < 16; i++)
     args->palette[i] = -1;
 
@@ -243,6 +304,101 @@ void parse_args(int argc, char *argv[], Args *args) {
       }
       args->cols = c;
       args->rows = r;
+    } else if (strcmp(argv[i], "--osc-max-bytes") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: --osc-max-bytes requires an argument\n");
+        print_usage(argv[0]);
+        exit(1);
+      }
+      args->osc_max_bytes = atoi(argv[++i]);
+      if (args->osc_max_bytes <= 0) {
+        fprintf(stderr, "Error: osc-max-bytes must be positive\n");
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "--ambiguous-width") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: --ambiguous-width requires an argument\n");
+        print_usage(argv[0]);
+        exit(1);
+      }
+      args->ambiguous_width = atoi(argv[++i]);
+      if (args->ambiguous_width != 1 && args->ambiguous_width != 2) {
+        fprintf(stderr, "Error: ambiguous-width must be 1 or 2\n");
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "--scrollback-compress") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: --scrollback-compress requires an argument\n");
+        print_usage(argv[0]);
+        exit(1);
+      }
+      args->scrollback_compress = atoi(argv[++i]);
+      if (args->scrollback_compress < 0) {
+        fprintf(stderr, "Error: scrollback-compress must not be negative\n");
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "--scrollback-file-mb") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: --scrollback-file-mb requires an argument\n");
+        print_usage(argv[0]);
+        exit(1);
+      }
+      args->scrollback_file_mb = atoi(argv[++i]);
+      if (args->scrollback_file_mb < 0) {
+        fprintf(stderr, "Error: scrollback-file-mb must not be negative\n");
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "--scrollback-max-bytes") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr,
+                "Error: --scrollback-max-bytes requires an argument\n");
+        print_usage(argv[0]);
+        exit(1);
+      }
+      args->scrollback_max_bytes = atol(argv[++i]);
+      if (args->scrollback_max_bytes < 0) {
+        fprintf(stderr, "Error: scrollback-max-bytes must not be negative\n");
+        exit(1);
+      }
+      if (args->scrollback_max_bytes > 0 &&
+          args->scrollback_max_bytes < SCROLLBACK_MIN_BUDGET) {
+        fprintf(stderr, "Error: scrollback-max-bytes must be 0 or at least %d\n",
+                SCROLLBACK_MIN_BUDGET);
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "--max-fps") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: --max-fps requires an argument\n");
+        print_usage(argv[0]);
+        exit(1);
+      }
+      args->max_fps = atoi(argv[++i]);
+      if (args->max_fps < 0) {
+        fprintf(stderr, "Error: max-fps must not be negative\n");
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "--read-slice-ms") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: --read-slice-ms requires an argument\n");
+        print_usage(argv[0]);
+        exit(1);
+      }
+      args->read_slice_ms = atoi(argv[++i]);
+      if (args->read_slice_ms <= 0) {
+        fprintf(stderr, "Error: read-slice-ms must be positive\n");
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "--read-slice-kb") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: --read-slice-kb requires an argument\n");
+        print_usage(argv[0]);
+        exit(1);
+      }
+      args->read_slice_kb = atoi(argv[++i]);
+      if (args->read_slice_kb <= 0) {
+        fprintf(stderr, "Error: read-slice-kb must be positive\n");
+        exit(1);
+      }
     } else if (strcmp(argv[i], "--help") == 0) {
       print_usage(argv[0]);
       exit(0);
@@ -14,6 +14,14 @@ typedef struct {
   int cols;    // 0 = derive from window pixel size
   int rows;    // 0 = derive from window pixel size
   char *title; // NULL = leave blank until shell sets it
+  int osc_max_bytes; // longest escape sequence kept; longer ones are dropped
+  int ambiguous_width; // columns for East Asian ambiguous characters, 1 or 2
+  int scrollback_compress; // lines kept uncompressed, 0 = never compress
+  int scrollback_file_mb;  // spill file size for evicted lines, 0 = off
+  long scrollback_max_bytes; // memory budget for scrollback lines, 0 = none
+  int max_fps; // frames drawn per second while output streams, 0 = refresh rate
+  int read_slice_ms; // longest time spent reading the shell before events
+  int read_slice_kb; // most output read from the shell before events
 } Args;
 
 void parse_args(int argc, char *argv[], Args *args);
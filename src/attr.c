@@ -0,0 +1,165 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "attr.h"
+#include "log.h"
+#include "screen.h"
+
+#define ATTR_INITIAL_CAPACITY 256
+
+static bool color_equal(const Term_Color *a, const Term_Color *b) {
+  if (a->type != b->type)
+    return false;
+  if (a->type == COLOR_RGB)
+    return a->rgb.red == b->rgb.red && a->rgb.green == b->rgb.green &&
+           a->rgb.blue == b->rgb.blue;
+  return a->color == b->color;
+}
+
+// Compares field by field: the unused half of a Term_Color union and struct
+// padding may hold anything
+static bool attr_equal(const Term_Attr *a, const Term_Attr *b) {
+  return color_equal(&a->fg, &b->fg) && color_equal(&a->bg, &b->bg) &&
+         !a->bold == !b->bold && !a->dim == !b->dim &&
+         !a->italic == !b->italic && !a->blink == !b->blink &&
+         !a->underline == !b->underline &&
+         !a->strikethrough == !b->strikethrough &&
+         !a->reverse == !b->reverse && a->uri_idx == b->uri_idx;
+}
+
+static uint32_t hash_mix(uint32_t h, uint32_t v) {
+  return (h ^ v) * 0x01000193; // FNV-1a, a word at a time
+}
+
+static uint32_t hash_color(uint32_t h, const Term_Color *c) {
+  h = hash_mix(h, c->type);
+  if (c->type == COLOR_RGB)
+    return hash_mix(h, c->rgb.red << 16 | c->rgb.green << 8 | c->rgb.blue);
+  return hash_mix(h, c->color);
+}
+
+static uint32_t hash_attr(const Term_Attr *a) {
+  uint32_t flags = (a->bold != 0) | (a->dim != 0) << 1 | (a->italic != 0) << 2 |
+                   (a->blink != 0) << 3 | (a->underline != 0) << 4 |
+                   (a->strikethrough != 0) << 5 | (a->reverse != 0) << 6;
+  uint32_t h = 2166136261u;
+  h = hash_color(h, &a->fg);
+  h = hash_color(h, &a->bg);
+  h = hash_mix(h, flags | (uint32_t)a->uri_idx << 8);
+  return h ^ (h >> 16);
+}
+
+static void insert_slot(Term_AttrTable *table, uint16_t id, uint32_t hash) {
+  uint32_t mask = table->slot_count - 1;
+  uint32_t i = hash & mask;
+  while (table->slots[i])
+    i = (i + 1) & mask;
+  table->slots[i] = id + 1;
+}
+
+// Rebuilds the hash from the ids in use; live may be NULL when all are
+static void rebuild_slots(Term_AttrTable *table, const uint8_t *live) {
+  memset(table->slots, 0, table->slot_count * sizeof(uint16_t));
+  for (int id = 0; id < table->count; id++)
+    if (!live || live[id])
+      insert_slot(table, id, hash_attr(&table->attrs[id]));
+}
+
+static bool grow(Term_AttrTable *table) {
+  int capacity = table->capacity * 2;
+  if (capacity > ATTR_MAX)
+    capacity = ATTR_MAX;
+  int slot_count = table->slot_count;
+  while (slot_count < capacity * 2)
+    slot_count *= 2;
+
+  Term_Attr *attrs = realloc(table->attrs, capacity * sizeof(Term_Attr));
+  if (!attrs)
+    return false;
+  table->attrs = attrs;
+  uint16_t *free_ids = realloc(table->free_ids, capacity * sizeof(uint16_t));
+  if (!free_ids)
+    return false;
+  table->free_ids = free_ids;
+  uint16_t *slots = malloc(slot_count * sizeof(uint16_t));
+  if (!slots)
+    return false;
+  free(table->slots);
+  table->slots = slots;
+  table->slot_count = slot_count;
+  table->capacity = capacity;
+  rebuild_slots(table, NULL);
+  return true;
+}
+
+// Mark and sweep: every id not referenced by a cell or cursor on either
+// screen goes back on the free list
+static void collect(Terminal *terminal) {
+  Term_AttrTable *table = &terminal->attrs;
+  uint8_t *live = calloc(table->capacity, 1);
+  if (!live)
+    return;
+  live[0] = 1;
+  mark_screen_refs(&terminal->screens.screen, terminal->dims.width,
+                   terminal->dims.height, live, NULL);
+  mark_screen_refs(&terminal->screens.alt_screen, terminal->dims.width,
+                   terminal->dims.height, live, NULL);
+
+  // Push the highest ids first so the lowest are handed out first
+  table->free_count = 0;
+  for (int id = table->count - 1; id > 0; id--)
+    if (!live[id])
+      table->free_ids[table->free_count++] = id;
+  rebuild_slots(table, live);
+  free(live);
+  LOG_DEBUG_MSG("attribute sweep freed %d of %d ids", table->free_count,
+                table->count);
+}
+
+void init_attrs(Term_AttrTable *table) {
+  table->capacity = ATTR_INITIAL_CAPACITY;
+  table->slot_count = ATTR_INITIAL_CAPACITY * 2;
+  table->attrs = calloc(table->capacity, sizeof(Term_Attr));
+  table->free_ids = malloc(table->capacity * sizeof(uint16_t));
+  table->slots = malloc(table->slot_count * sizeof(uint16_t));
+  table->free_count = 0;
+  table->count = 1; // id 0 is the default attribute and is never freed
+  rebuild_slots(table, NULL);
+}
+
+void free_attrs(Term_AttrTable *table) {
+  free(table->attrs);
+  free(table->free_ids);
+  free(table->slots);
+  memset(table, 0, sizeof(*table));
+}
+
+// Returns the id of attr, adding it to the table if it is new. When every id
+// is referenced the default attribute is used instead.
+uint16_t intern_attr(Terminal *terminal, const Term_Attr *attr) {
+  Term_AttrTable *table = &terminal->attrs;
+  uint32_t hash = hash_attr(attr);
+  uint32_t mask = table->slot_count - 1;
+  for (uint32_t i = hash & mask; table->slots[i]; i = (i + 1) & mask) {
+    uint16_t id = table->slots[i] - 1;
+    if (attr_equal(&table->attrs[id], attr))
+      return id;
+  }
+
+  if (table->free_count == 0 && table->count == table->capacity) {
+    if (table->capacity < ATTR_MAX)
+      grow(table);
+    else
+      collect(terminal);
+    if (table->free_count == 0 && table->count == table->capacity) {
+      LOG_WARNING_MSG("attribute table full, using default attributes");
+      return 0;
+    }
+  }
+
+  uint16_t id = table->free_count > 0 ? table->free_ids[--table->free_count]
+                                      : table->count++;
+  table->attrs[id] = *attr;
+  insert_slot(table, id, hash);
+  return id;
+}
@@ -0,0 +1,10 @@
+#ifndef ATTR_H
+#define ATTR_H
+
+#include "terminal.h"
+
+void init_attrs(Term_AttrTable *table);
+void free_attrs(Term_AttrTable *table);
+uint16_t intern_attr(Terminal *terminal, const Term_Attr *attr);
+
+#endif
@@ -0,0 +1,179 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "cluster.h"
+#include "log.h"
+#include "screen.h"
+
+#define CLUSTER_INITIAL_CAPACITY 64
+
+static uint32_t hash_cluster(const uint32_t *cps, int count) {
+  uint32_t h = 2166136261u;
+  for (int i = 0; i < count; i++)
+    h = (h ^ cps[i]) * 0x01000193;
+  return h ^ (h >> 16);
+}
+
+static void insert_slot(Term_ClusterTable *table, uint32_t id, uint32_t hash) {
+  uint32_t mask = table->slot_count - 1;
+  uint32_t i = hash & mask;
+  while (table->slots[i])
+    i = (i + 1) & mask;
+  table->slots[i] = id + 1;
+}
+
+// Rebuilds the hash from the ids in use; live may be NULL when all are
+static void rebuild_slots(Term_ClusterTable *table, const uint8_t *live) {
+  memset(table->slots, 0, table->slot_count * sizeof(uint32_t));
+  for (int id = 0; id < table->count; id++)
+    if (!live || live[id])
+      insert_slot(table, id,
+                  hash_cluster(table->clusters[id].cps,
+                               table->clusters[id].count));
+}
+
+static bool grow(Term_ClusterTable *table) {
+  int capacity = table->capacity * 2;
+  if (capacity > CLUSTER_ID_MAX)
+    capacity = CLUSTER_ID_MAX;
+  int slot_count = table->slot_count;
+  while (slot_count < capacity * 2)
+    slot_count *= 2;
+
+  Term_Cluster *clusters =
+      realloc(table->clusters, capacity * sizeof(Term_Cluster));
+  if (!clusters)
+    return false;
+  table->clusters = clusters;
+  uint32_t *free_ids = realloc(table->free_ids, capacity * sizeof(uint32_t));
+  if (!free_ids)
+    return false;
+  table->free_ids = free_ids;
+  uint32_t *slots = malloc(slot_count * sizeof(uint32_t));
+  if (!slots)
+    return false;
+  free(table->slots);
+  table->slots = slots;
+  table->slot_count = slot_count;
+  table->capacity = capacity;
+  rebuild_slots(table, NULL);
+  return true;
+}
+
+// Mark and sweep, as for attributes
+static void collect(Terminal *terminal) {
+  Term_ClusterTable *table = &terminal->clusters;
+  uint8_t *live = calloc(table->capacity, 1);
+  if (!live)
+    return;
+  mark_screen_refs(&terminal->screens.screen, terminal->dims.width,
+                   terminal->dims.height, NULL, live);
+  mark_screen_refs(&terminal->screens.alt_screen, terminal->dims.width,
+                   terminal->dims.height, NULL, live);
+
+  table->free_count = 0;
+  for (int id = table->count - 1; id >= 0; id--)
+    if (!live[id])
+      table->free_ids[table->free_count++] = id;
+  rebuild_slots(table, live);
+  free(live);
+  LOG_DEBUG_MSG("cluster sweep freed %d of %d ids", table->free_count,
+                table->count);
+}
+
+void init_clusters(Term_ClusterTable *table) {
+  table->capacity = CLUSTER_INITIAL_CAPACITY;
+  table->slot_count = CLUSTER_INITIAL_CAPACITY * 2;
+  table->clusters = malloc(table->capacity * sizeof(Term_Cluster));
+  table->free_ids = malloc(table->capacity * sizeof(uint32_t));
+  table->slots = calloc(table->slot_count, sizeof(uint32_t));
+  table->free_count = 0;
+  table->count = 0;
+}
+
+void free_clusters(Term_ClusterTable *table) {
+  free(table->clusters);
+  free(table->free_ids);
+  free(table->slots);
+  memset(table, 0, sizeof(*table));
+}
+
+// Returns the id of a base character followed by its combining marks, adding
+// it to the table if it is new, or CLUSTER_NONE if the table is full
+uint32_t intern_cluster(Terminal *terminal, const uint32_t *cps, int count) {
+  Term_ClusterTable *table = &terminal->clusters;
+  uint32_t hash = hash_cluster(cps, count);
+  uint32_t mask = table->slot_count - 1;
+  for (uint32_t i = hash & mask; table->slots[i]; i = (i + 1) & mask) {
+    Term_Cluster *c = &table->clusters[table->slots[i] - 1];
+    if (c->count == count && memcmp(c->cps, cps, count * sizeof(*cps)) == 0)
+      return table->slots[i] - 1;
+  }
+
+  if (table->free_count == 0 && table->count == table->capacity) {
+    if (table->capacity < CLUSTER_ID_MAX)
+      grow(table);
+    else
+      collect(terminal);
+    if (table->free_count == 0 && table->count == table->capacity) {
+      LOG_WARNING_MSG("cluster table full, dropping combining character");
+      return CLUSTER_NONE;
+    }
+  }
+
+  uint32_t id = table->free_count > 0 ? table->free_ids[--table->free_count]
+                                      : (uint32_t)table->count++;
+  table->clusters[id].count = count;
+  memcpy(table->clusters[id].cps, cps, count * sizeof(*cps));
+  insert_slot(table, id, hash);
+  return id;
+}
+
+// Writes the code points shown in cell to out (up to CLUSTER_MAX) and
+// returns how many there are; 0 for an empty cell
+int cell_codepoints(const Term_ClusterTable *table, Term_Cell cell,
+                    uint32_t *out) {
+  if (cell.flags & CELL_CLUSTER) {
+    const Term_Cluster *c = &table->clusters[cell.cp];
+    memcpy(out, c->cps, c->count * sizeof(*out));
+    return c->count;
+  }
+  if (cell.cp == 0)
+    return 0;
+  out[0] = cell.cp;
+  return 1;
+}
+
+static int utf8_encode(uint32_t cp, char *out) {
+  if (cp < 0x80) {
+    out[0] = cp;
+    return 1;
+  }
+  if (cp < 0x800) {
+    out[0] = 0xC0 | (cp >> 6);
+    out[1] = 0x80 | (cp & 0x3F);
+    return 2;
+  }
+  if (cp < 0x10000) {
+    out[0] = 0xE0 | (cp >> 12);
+    out[1] = 0x80 | ((cp >> 6) & 0x3F);
+    out[2] = 0x80 | (cp & 0x3F);
+    return 3;
+  }
+  out[0] = 0xF0 | (cp >> 18);
+  out[1] = 0x80 | ((cp >> 12) & 0x3F);
+  out[2] = 0x80 | ((cp >> 6) & 0x3F);
+  out[3] = 0x80 | (cp & 0x3F);
+  return 4;
+}
+
+// Writes the UTF-8 text of cell to out, which must hold CELL_TEXT_MAX bytes,
+// and returns its length; 0 for an empty cell
+int cell_text(const Term_ClusterTable *table, Term_Cell cell, char *out) {
+  uint32_t cps[CLUSTER_MAX];
+  int count = cell_codepoints(table, cell, cps);
+  int len = 0;
+  for (int i = 0; i < count; i++)
+    len += utf8_encode(cps[i], out + len);
+  return len;
+}
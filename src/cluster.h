@@ -0,0 +1,15 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include "terminal.h"
+
+#define CLUSTER_NONE UINT32_MAX
+
+void init_clusters(Term_ClusterTable *table);
+void free_clusters(Term_ClusterTable *table);
+uint32_t intern_cluster(Terminal *terminal, const uint32_t *cps, int count);
+int cell_codepoints(const Term_ClusterTable *table, Term_Cell cell,
+                    uint32_t *out);
+int cell_text(const Term_ClusterTable *table, Term_Cell cell, char *out);
+
+#endif
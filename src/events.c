@@ -12,6 +12,8 @@
 #include "events.h"
 #include "log.h"
 #include "render.h"
+#include "screen.h"
+#include "scrollback.h"
 
 static void send_mouse_event(GuiContext *gui, Terminal *terminal, int btn,
                              int x, int y, bool release) {
@@ -50,6 +52,7 @@ static void on_configure(GuiContext *gui, Terminal *terminal,
   XFreePixmap(gui->x11.display, gui->surface.backbuffer);
   gui->surface.backbuffer = XCreatePixmap(gui->x11.display, gui->x11.window, gui->surface.window_width,
                                   gui->surface.window_height, depth);
+  gui->frame.full = true;
 
   XftDrawDestroy(gui->color.xft_draw);
   gui->color.xft_draw =
@@ -86,8 +89,8 @@ static void on_configure(GuiContext *gui, Terminal *terminal,
 }
 
 static void on_key_press(GuiContext *gui, Terminal *terminal, XKeyEvent *ev) {
-  gui->cursor.cursor_visible = true;
-  clock_gettime(CLOCK_MONOTONIC, &gui->cursor.last_blink);
+  gui->pacing.input = true;
+  restart_blink(gui);
 
   char buffer[32];
   KeySym keysym;
@@ -166,6 +169,9 @@ static void on_key_press(GuiContext *gui, Terminal *terminal, XKeyEvent *ev) {
     if (gui->selection.has_selection)
       XSetSelectionOwner(gui->x11.display, gui->selection.atom_clipboard, gui->x11.window,
                          CurrentTime);
+  } else if ((keysym == XK_m || keysym == XK_M) && (ev->state & ControlMask) &&
+             (ev->state & ShiftMask)) {
+    log_scrollback_stats(&terminal->screens.screen.scrollback, "Main");
   } else if ((keysym == XK_v || keysym == XK_V) && (ev->state & ControlMask) &&
              (ev->state & ShiftMask)) {
     XConvertSelection(gui->x11.display, gui->selection.atom_clipboard, gui->selection.atom_utf8_string,
@@ -274,37 +280,33 @@ static void on_key_press(GuiContext *gui, Terminal *terminal, XKeyEvent *ev) {
   }
 }
 
-static Term_Cell *cell_at(Term_Screen *scr, Terminal *terminal, int abs_row,
-                          int col) {
+static Term_Cell cell_at(Term_Screen *scr, Terminal *terminal, int abs_row,
+                         int col) {
   if (abs_row < 0 || col < 0)
-    return NULL;
-  if (abs_row < scr->scrollback.count) {
-    int sb_idx = (scr->scrollback.head + abs_row) % scr->scrollback.capacity;
-    if (col >= scr->scrollback.widths[sb_idx])
-      return NULL;
-    return &scr->scrollback.lines[sb_idx][col];
-  }
+    return (Term_Cell){0};
+  if (abs_row < scr->scrollback.count)
+    return scrollback_cell(&scr->scrollback, abs_row, col);
   int row = abs_row - scr->scrollback.count;
   if (row >= terminal->dims.height || col >= terminal->dims.width)
-    return NULL;
-  return &scr->lines[row].cells[col];
+    return (Term_Cell){0};
+  return screen_line(scr, row)[col];
 }
 
-static bool is_word_char(Term_Cell *cell) {
-  if (!cell || cell->length == 0)
+static bool is_word_char(Term_Cell cell) {
+  if (cell.cp == 0)
     return false;
-  unsigned char c = (unsigned char)cell->data[0];
+  if (cell.flags & CELL_CLUSTER)
+    return true;
+  uint32_t c = cell.cp;
   return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
          (c >= '0' && c <= '9') || c == '_' || c > 127;
 }
 
 static void select_word(GuiContext *gui, Terminal *terminal, Term_Screen *scr,
                         int abs_row, int col) {
-  int row_width =
-      (abs_row < scr->scrollback.count)
-          ? scr->scrollback.widths[(scr->scrollback.head + abs_row) %
-                                   scr->scrollback.capacity]
-          : terminal->dims.width;
+  int row_width = (abs_row < scr->scrollback.count)
+                      ? scrollback_width(&scr->scrollback, abs_row)
+                      : terminal->dims.width;
 
   int start = col;
   int end = col;
@@ -345,11 +347,16 @@ static void on_button_press(GuiContext *gui, Terminal *terminal,
 
   if (ev->button == Button1 && (ev->state & ControlMask)) {
     int abs_row = scr->scrollback.count - scr->scroll_offset + cell_y;
-    Term_Cell *lc = cell_at(scr, terminal, abs_row, cell_x);
-    if (lc && lc->attr.uri_idx > 0) {
-      const char *uri = terminal->uri.uri_table[lc->attr.uri_idx - 1];
+    Term_Cell lc = cell_at(scr, terminal, abs_row, cell_x);
+    uint16_t uri_idx = terminal->attrs.attrs[lc.attr].uri_idx;
+    if (uri_idx > 0) {
+      const char *uri = terminal->uri.uri_table[uri_idx - 1];
       pid_t pid = fork();
       if (pid == 0) {
+        // Undo the GUI's SIGCHLD block, as for the shell
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
         setsid();
         execlp("xdg-open", "xdg-open", uri, (char *)NULL);
         _exit(1);
@@ -595,7 +602,7 @@ static void on_selection_notify(GuiContext *gui, Terminal *terminal,
 void handle_events(GuiContext *gui, Terminal *terminal, XEvent *event) {
   switch (event->type) {
   case Expose:
-    draw_terminal(gui, terminal);
+    expose_terminal(gui, terminal, &event->xexpose);
     break;
   case ConfigureNotify:
     on_configure(gui, terminal, &event->xconfigure);
@@ -618,5 +625,10 @@ void handle_events(GuiContext *gui, Terminal *terminal, XEvent *event) {
   case SelectionNotify:
     on_selection_notify(gui, terminal, &event->xselection);
     break;
+  case FocusIn:
+  case FocusOut:
+    // Only the focused window blinks, so windows in the background sleep
+    gui->cursor.focused = event->type == FocusIn;
+    break;
   }
 }
@@ -1,9 +1,16 @@
+#ifdef HAVE_XRANDR
+#include <X11/extensions/Xrandr.h>
+#endif
+#include <errno.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
-#include <sys/select.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
@@ -15,6 +22,122 @@
 #include "shell.h"
 #include "terminal.h"
 
+// The screen's refresh rate from XRandR, or 0 if it can't be read or the
+// build has no XRandR
+static int refresh_rate(Display *display) {
+#ifdef HAVE_XRANDR
+  XRRScreenConfiguration *info =
+      XRRGetScreenInfo(display, DefaultRootWindow(display));
+  if (!info)
+    return 0;
+  int rate = XRRConfigCurrentRate(info);
+  XRRFreeScreenConfigInfo(info);
+  return rate;
+#else
+  (void)display;
+  return 0;
+#endif
+}
+
+static long elapsed_ns(const struct timespec *from, const struct timespec *to) {
+  return (to->tv_sec - from->tv_sec) * 1000000000L + (to->tv_nsec - from->tv_nsec);
+}
+
+// How long an application may hold drawing with mode 2026 before the
+// screen is drawn anyway
+#define SYNC_TIMEOUT_NS 150000000L
+
+// Nanoseconds until a synchronized update may no longer hold drawing, or 0
+// if none is holding it
+static long sync_hold_ns(GuiContext *gui, Terminal *terminal,
+                         const struct timespec *now) {
+  if (!terminal->modes.synchronized)
+    return 0;
+  long left = SYNC_TIMEOUT_NS - elapsed_ns(&gui->pacing.sync_start, now);
+  return left > 0 ? left : 0;
+}
+
+#define BLINK_NS 500000000L
+#define BELL_FLASH_NS 150000000L
+
+// Arms a timerfd to expire after delay_ns and then every interval_ns.
+// A delay of 0 disarms it.
+static void arm_timer(int fd, long delay_ns, long interval_ns) {
+  struct itimerspec spec = {
+      .it_interval = {interval_ns / 1000000000L, interval_ns % 1000000000L},
+      .it_value = {delay_ns / 1000000000L, delay_ns % 1000000000L},
+  };
+  timerfd_settime(fd, 0, &spec, NULL);
+}
+
+// Reads a timerfd's expiry count so that epoll stops reporting it
+static void drain_timer(int fd) {
+  uint64_t expirations;
+  if (read(fd, &expirations, sizeof(expirations)) < 0)
+    return;
+}
+
+static void watch_fd(GuiContext *gui, int fd) {
+  struct epoll_event ev = {.events = EPOLLIN, .data.fd = fd};
+  epoll_ctl(gui->loop.epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+void restart_blink(GuiContext *gui) {
+  gui->cursor.cursor_visible = true;
+  if (gui->cursor.blinking)
+    arm_timer(gui->loop.blink_fd, BLINK_NS, BLINK_NS);
+}
+
+// Arms the blink timer while a blinking cursor or blinking text is on
+// screen in the focused window, and disarms it otherwise, leaving the cursor
+// shown. Blinking text follows the cursor's phase, so it only blinks when the
+// cursor does.
+static void update_blink(GuiContext *gui, Terminal *terminal) {
+  Term_Screen *scr =
+      terminal->screens.using_alt_screen ? &terminal->screens.alt_screen : &terminal->screens.screen;
+  bool shape_steady = terminal->modes.cursor_shape % 2 == 0 && terminal->modes.cursor_shape != 0;
+  bool cursor_shown = !scr->cursor_hidden && scr->scroll_offset == 0;
+  bool blinking = gui->cursor.focused && terminal->modes.cursor_blink && !shape_steady &&
+                  (cursor_shown || gui->frame.has_blink);
+  if (blinking == gui->cursor.blinking)
+    return;
+  gui->cursor.blinking = blinking;
+  arm_timer(gui->loop.blink_fd, blinking ? BLINK_NS : 0, BLINK_NS);
+  if (!blinking && !gui->cursor.cursor_visible) {
+    gui->cursor.cursor_visible = true;
+    draw_terminal(gui, terminal);
+  }
+}
+
+// Creates the event loop's epoll set, timers and SIGCHLD signalfd. SIGCHLD is
+// blocked before the shell is forked so that its exit can't be missed.
+static int init_loop(GuiContext *gui) {
+  sigset_t sigchld;
+  sigemptyset(&sigchld);
+  sigaddset(&sigchld, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &sigchld, NULL);
+
+  gui->loop.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  gui->loop.signal_fd = signalfd(-1, &sigchld, SFD_NONBLOCK | SFD_CLOEXEC);
+  gui->loop.blink_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  gui->loop.bell_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  gui->loop.frame_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  gui->loop.frame_armed = false;
+  if (gui->loop.epoll_fd < 0 || gui->loop.signal_fd < 0 || gui->loop.blink_fd < 0 ||
+      gui->loop.bell_fd < 0 || gui->loop.frame_fd < 0) {
+    perror("epoll");
+    LOG_ERROR_MSG("Failed to set up the event loop");
+    return 1;
+  }
+
+  watch_fd(gui, ConnectionNumber(gui->x11.display));
+  watch_fd(gui, gui->loop.signal_fd);
+  watch_fd(gui, gui->loop.blink_fd);
+  watch_fd(gui, gui->loop.bell_fd);
+  watch_fd(gui, gui->loop.frame_fd);
+  return 0;
+}
+
 int init_gui(GuiContext *gui, Args *args) {
   int font_size = args->font_size;
   LOG_INFO_MSG("Initializing GUI with font size %d", font_size);
@@ -77,7 +200,8 @@ int init_gui(GuiContext *gui, Args *args) {
   XSelectInput(gui->x11.display, gui->x11.window,
                ExposureMask | KeyPressMask | ButtonPressMask |
                    ButtonReleaseMask | Button1MotionMask | Button2MotionMask |
-                   Button3MotionMask | PointerMotionMask | StructureNotifyMask);
+                   Button3MotionMask | PointerMotionMask | StructureNotifyMask |
+                   FocusChangeMask);
 
   XStoreName(gui->x11.display, gui->x11.window,
              args->title ? args->title : "Terminal GUI");
@@ -178,8 +302,22 @@ int init_gui(GuiContext *gui, Args *args) {
   }
 
   gui->cursor.cursor_visible = true;
-  clock_gettime(CLOCK_MONOTONIC, &gui->cursor.last_blink);
+  gui->cursor.blinking = false;
+  gui->cursor.focused = true;
   gui->bell.bell_flash = false;
+  memset(&gui->frame, 0, sizeof(gui->frame));
+  memset(&gui->pacing, 0, sizeof(gui->pacing));
+  int fps = args->max_fps ? args->max_fps : refresh_rate(gui->x11.display);
+  if (fps <= 0)
+    fps = 60;
+  gui->pacing.frame_ns = 1000000000L / fps;
+  LOG_INFO_MSG("Drawing streamed output at up to %d fps", fps);
+  gui->process.read_buffer = NULL;
+  gui->process.read_size = 0;
+  gui->process.read_slice_ns = args->read_slice_ms * 1000000L;
+  gui->process.read_slice_bytes = (size_t)args->read_slice_kb * 1024;
+  memset(gui->fonts.glyph_cache, 0, sizeof(gui->fonts.glyph_cache));
+  gui->frame.full = true;
   gui->click.last_click_time.tv_sec = 0;
   gui->click.last_click_time.tv_nsec = 0;
   gui->click.last_click_x = -1;
@@ -189,7 +327,7 @@ int init_gui(GuiContext *gui, Args *args) {
   memset(gui->color.rgb_cache_valid, 0, sizeof(gui->color.rgb_cache_valid));
   gui->color.rgb_cache_next = 0;
 
-  return 0;
+  return init_loop(gui);
 }
 
 void change_font_size(GuiContext *gui, Terminal *terminal, int delta) {
@@ -205,6 +343,7 @@ void change_font_size(GuiContext *gui, Terminal *terminal, int delta) {
     XftFontClose(gui->x11.display, gui->fonts.font_bold);
   if (italic_separate)
     XftFontClose(gui->x11.display, gui->fonts.font_italic);
+  memset(gui->fonts.glyph_cache, 0, sizeof(gui->fonts.glyph_cache));
 
   char pattern[512];
   snprintf(pattern, sizeof(pattern), "%s:size=%d", gui->fonts.font_base, new_size);
@@ -272,6 +411,7 @@ void change_font_size(GuiContext *gui, Terminal *terminal, int delta) {
     term_rows = 1;
 
   resize_terminal(terminal, term_cols, term_rows);
+  gui->frame.full = true;
 
   struct winsize ws = {
       .ws_row = term_rows,
@@ -299,6 +439,11 @@ void cleanup_gui(GuiContext *gui) {
     kill(gui->process.child_pid, SIGTERM);
     waitpid(gui->process.child_pid, NULL, 0);
   }
+  close(gui->loop.epoll_fd);
+  close(gui->loop.signal_fd);
+  close(gui->loop.blink_fd);
+  close(gui->loop.bell_fd);
+  close(gui->loop.frame_fd);
 
   Visual *visual = gui->x11.visual;
   Colormap colormap = gui->x11.colormap;
@@ -323,6 +468,7 @@ void cleanup_gui(GuiContext *gui) {
     XRenderFreePicture(gui->x11.display, gui->surface.backbuffer_picture);
 
   free(gui->selection.selection_text);
+  free(gui->process.read_buffer);
 
   XftDrawDestroy(gui->color.xft_draw);
   XftFontClose(gui->x11.display, gui->fonts.font);
@@ -368,65 +514,80 @@ int main(int argc, char *argv[]) {
     term_rows = 1;
   init_terminal(&terminal, term_cols, term_rows, args.scrollback);
   terminal.osc.default_fg_rgb = (args.fg != -1) ? (unsigned long)args.fg : 0xffffff;
+  terminal.parser.max_sequence = args.osc_max_bytes;
+  terminal.screens.screen.ambiguous_wide = args.ambiguous_width == 2;
+  terminal.screens.screen.scrollback.compress_after = args.scrollback_compress;
+  terminal.screens.screen.scrollback.max_bytes = args.scrollback_max_bytes;
+  terminal.screens.screen.scrollback.spill.segment_size =
+      (size_t)args.scrollback_file_mb * 1024 * 1024 / SPILL_SEGMENTS;
   init_shell(&gui, term_cols, term_rows);
 
   XMapWindow(gui.x11.display, gui.x11.window);
+  watch_fd(&gui, gui.process.pipe_fd);
 
+  struct epoll_event events[8];
   while (running) {
-    fd_set read_fds;
-    FD_ZERO(&read_fds);
-    FD_SET(gui.process.pipe_fd, &read_fds);
-    int x11_fd = ConnectionNumber(gui.x11.display);
-    FD_SET(x11_fd, &read_fds);
-    int max_fd = (gui.process.pipe_fd > x11_fd) ? gui.process.pipe_fd : x11_fd;
-
-    struct timeval timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 50000;
-
-    int activity = select(max_fd + 1, &read_fds, NULL, NULL, &timeout);
-
-    if (activity < 0) {
-      perror("select");
+    while (XPending(gui.x11.display)) {
+      XNextEvent(gui.x11.display, &event);
+      handle_events(&gui, &terminal, &event);
+    }
+    update_blink(&gui, &terminal);
+    // Drawing may have read events into Xlib's queue, where epoll can't see
+    // them
+    if (XEventsQueued(gui.x11.display, QueuedAlready))
+      continue;
+    XFlush(gui.x11.display);
+
+    int ready = epoll_wait(gui.loop.epoll_fd, events, 8, -1);
+    if (ready < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("epoll_wait");
       break;
     }
 
     struct timespec now;
     clock_gettime(CLOCK_MONOTONIC, &now);
-    long elapsed_ms = (now.tv_sec - gui.cursor.last_blink.tv_sec) * 1000 +
-                      (now.tv_nsec - gui.cursor.last_blink.tv_nsec) / 1000000;
-    bool shape_steady = terminal.modes.cursor_shape % 2 == 0 && terminal.modes.cursor_shape != 0;
-    bool steady = shape_steady || !terminal.modes.cursor_blink;
-    if (elapsed_ms >= 500) {
-      gui.cursor.cursor_visible = steady ? true : !gui.cursor.cursor_visible;
-      gui.cursor.last_blink = now;
-      draw_terminal(&gui, &terminal);
-      XFlush(gui.x11.display);
-    }
-
-    if (gui.bell.bell_flash) {
-      long bell_ms = (now.tv_sec - gui.bell.bell_start.tv_sec) * 1000 +
-                     (now.tv_nsec - gui.bell.bell_start.tv_nsec) / 1000000;
-      if (bell_ms >= 150) {
+    bool output = false;
+    for (int i = 0; i < ready; i++) {
+      int fd = events[i].data.fd;
+      if (fd == gui.loop.signal_fd) {
+        struct signalfd_siginfo info;
+        while (read(fd, &info, sizeof(info)) > 0)
+          ;
+        // Reap the shell and any link opener started by a Ctrl+click
+        pid_t pid;
+        while ((pid = waitpid(-1, NULL, WNOHANG)) != 0) {
+          if (pid < 0) {
+            if (errno == EINTR)
+              continue;
+            if (errno == ECHILD)
+              running = 0;
+            break;
+          }
+          if (pid == gui.process.child_pid)
+            running = 0;
+        }
+      } else if (fd == gui.loop.blink_fd) {
+        drain_timer(fd);
+        if (!sync_hold_ns(&gui, &terminal, &now)) {
+          gui.cursor.cursor_visible = !gui.cursor.cursor_visible;
+          draw_terminal(&gui, &terminal);
+        }
+      } else if (fd == gui.loop.bell_fd) {
+        drain_timer(fd);
         gui.bell.bell_flash = false;
         draw_terminal(&gui, &terminal);
-        XFlush(gui.x11.display);
+      } else if (fd == gui.loop.frame_fd) {
+        drain_timer(fd);
+      } else if (fd == gui.process.pipe_fd) {
+        output = true;
       }
     }
-
-    while (XPending(gui.x11.display)) {
-      XNextEvent(gui.x11.display, &event);
-      handle_events(&gui, &terminal, &event);
-    }
-
-    int status;
-    pid_t result = waitpid(gui.process.child_pid, &status, WNOHANG);
-    if (result != 0) {
-      running = 0;
+    if (!running)
       break;
-    }
 
-    if (FD_ISSET(gui.process.pipe_fd, &read_fds)) {
+    if (output) {
       read_shell_output(&gui, &terminal);
       if (terminal.screens.screen.scrolled || terminal.screens.alt_screen.scrolled) {
         gui.selection.has_selection = false;
@@ -462,6 +623,7 @@ int main(int argc, char *argv[]) {
         XftColorAllocValue(gui.x11.display, visual, colormap, &xrender_color,
                            &gui.color.xft_default_fg);
         terminal.osc.fg_dirty = false;
+        gui.frame.full = true;
       }
       if (terminal.osc.bg_dirty) {
         unsigned long bg_val = terminal.osc.osc_bg;
@@ -484,10 +646,11 @@ int main(int argc, char *argv[]) {
         XftColorAllocValue(gui.x11.display, visual, colormap, &xrender_color,
                            &gui.color.xft_default_bg);
         terminal.osc.bg_dirty = false;
+        gui.frame.full = true;
       }
       if (terminal.modes.bell_pending) {
         gui.bell.bell_flash = true;
-        gui.bell.bell_start = now;
+        arm_timer(gui.loop.bell_fd, BELL_FLASH_NS, 0);
         terminal.modes.bell_pending = false;
       }
       if (terminal.osc.osc52_dirty) {
@@ -501,8 +664,39 @@ int main(int argc, char *argv[]) {
         XSetSelectionOwner(gui.x11.display, gui.selection.atom_clipboard, gui.x11.window,
                            CurrentTime);
       }
-      draw_terminal(&gui, &terminal);
-      XFlush(gui.x11.display);
+      if (terminal.modes.sync_begun) {
+        gui.pacing.sync_start = now;
+        terminal.modes.sync_begun = false;
+      }
+      gui.pacing.pending = true;
+    }
+
+    // Keep parsing while output streams and draw once per frame interval,
+    // unless the application is in the middle of a synchronized update
+    if (gui.pacing.pending) {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      bool due = gui.pacing.input ||
+                 elapsed_ns(&gui.pacing.last_frame, &now) >= gui.pacing.frame_ns;
+      if (due && !sync_hold_ns(&gui, &terminal, &now)) {
+        draw_terminal(&gui, &terminal);
+        XFlush(gui.x11.display);
+        gui.pacing.last_frame = now;
+        gui.pacing.pending = false;
+        gui.pacing.input = false;
+      }
+    }
+
+    // Wake up in time to draw the output held back for the next frame
+    if (gui.pacing.pending) {
+      long wait_ns = gui.pacing.frame_ns - elapsed_ns(&gui.pacing.last_frame, &now);
+      long hold_ns = sync_hold_ns(&gui, &terminal, &now);
+      if (hold_ns > wait_ns)
+        wait_ns = hold_ns;
+      arm_timer(gui.loop.frame_fd, wait_ns > 0 ? wait_ns : 1, 0);
+      gui.loop.frame_armed = true;
+    } else if (gui.loop.frame_armed) {
+      arm_timer(gui.loop.frame_fd, 0, 0);
+      gui.loop.frame_armed = false;
     }
   }
 
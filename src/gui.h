@@ -14,6 +14,7 @@
 #include "terminal.h"
 
 #define SEARCH_MAX_MATCHES 4096
+#define GLYPH_CACHE_SIZE 4096 // power of two
 
 typedef struct {
   Display *display;
@@ -25,6 +26,13 @@ typedef struct {
   bool owns_colormap;
 } GuiX11;
 
+// A glyph index looked up for a code point in one of the three fonts.
+// key is cp << 2 | style, 0 when the slot is empty.
+typedef struct {
+  uint32_t key;
+  FT_UInt glyph;
+} GuiGlyph;
+
 typedef struct {
   XftFont *font;
   XftFont *font_bold;
@@ -35,6 +43,7 @@ typedef struct {
   char font_italic_base[256];
   int char_width, char_height;
   int char_ascent;
+  GuiGlyph glyph_cache[GLYPH_CACHE_SIZE];
 } GuiFonts;
 
 typedef struct {
@@ -64,10 +73,17 @@ typedef struct {
   int alpha;
 } GuiSurface;
 
+#define READ_BUFFER_MIN (64 * 1024)
+#define READ_BUFFER_MAX (1024 * 1024)
+
 typedef struct {
   int pipe_fd;
   int input_fd;
   pid_t child_pid;
+  char *read_buffer; // grows while reads fill it, shrinks when they don't
+  size_t read_size;
+  long read_slice_ns; // read no longer than this before handling events
+  size_t read_slice_bytes; // or more than this
 } GuiProcess;
 
 typedef struct {
@@ -84,14 +100,36 @@ typedef struct {
 
 typedef struct {
   bool cursor_visible;
-  struct timespec last_blink;
+  bool blinking; // the blink timer is armed
+  bool focused;  // the window has the keyboard focus
 } GuiCursor;
 
 typedef struct {
   bool bell_flash;
-  struct timespec bell_start;
 } GuiBell;
 
+// The main loop sleeps in epoll_wait on X, the PTY, child exit and the timers
+// below. Timers are only armed while something needs them, so an idle window
+// isn't woken until there is input.
+typedef struct {
+  int epoll_fd;
+  int signal_fd; // SIGCHLD
+  int blink_fd;  // cursor and text blink, while either is shown
+  int bell_fd;   // end of the bell flash
+  int frame_fd;  // next paced frame, while output is held back
+  bool frame_armed;
+} GuiLoop;
+
+// Output is drawn at most once per frame_ns, except for the first output
+// after a keypress, which is drawn at once so typing echoes without delay
+typedef struct {
+  long frame_ns;
+  struct timespec last_frame;
+  bool pending; // output arrived that hasn't been drawn
+  bool input;   // a key was pressed since the last frame
+  struct timespec sync_start; // when the current synchronized update began
+} GuiPacing;
+
 typedef struct {
   struct timespec last_click_time;
   int last_click_x;
@@ -109,6 +147,25 @@ typedef struct {
   int search_current;
 } GuiSearch;
 
+// What the backbuffer shows, so draw_terminal() can repaint only what has
+// changed since. Cursor and selection rows are in the same coordinates as
+// the draw: screen cells and combined scrollback rows.
+typedef struct {
+  bool full; // repaint everything on the next draw
+  const Term_Screen *screen;
+  int scroll_offset;
+  int scrollback_count;
+  bool bell_flash;
+  bool search_active;
+  bool blink_visible; // cursor_visible when blinking text was last drawn
+  bool has_blink;     // blinking text may be on screen
+  int cursor_x, cursor_y; // -1 when no cursor was drawn
+  int cursor_shape;
+  bool has_selection;
+  int sel_start_x, sel_start_y, sel_end_x, sel_end_y;
+  int mark_count, mark_head;
+} GuiFrame;
+
 typedef struct {
   GuiX11 x11;
   GuiFonts fonts;
@@ -120,10 +177,14 @@ typedef struct {
   GuiBell bell;
   GuiClick click;
   GuiSearch search;
+  GuiFrame frame;
+  GuiPacing pacing;
+  GuiLoop loop;
 } GuiContext;
 
 int init_gui(GuiContext *gui, Args *args);
 void cleanup_gui(GuiContext *gui);
 void change_font_size(GuiContext *gui, Terminal *terminal, int delta);
+void restart_blink(GuiContext *gui);
 
 #endif
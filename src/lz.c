@@ -0,0 +1,165 @@
+#include <string.h>
+
+#include "lz.h"
+
+// A small LZ77 codec in the style of LZ4. A block is a series of sequences,
+// each a token byte (literal length in the high nibble, match length - 4 in
+// the low one, 15 meaning more length bytes follow), the literals, a 16-bit
+// little-endian match offset and any extra match length bytes. The last
+// sequence has literals only.
+
+#define HASH_BITS 12
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+
+static inline uint32_t read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint64_t read64(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint32_t hash(uint32_t v) {
+  return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static uint8_t *put_length(uint8_t *op, int len) {
+  for (; len >= 255; len -= 255)
+    *op++ = 255;
+  *op++ = len;
+  return op;
+}
+
+static uint8_t *put_literals(uint8_t *op, const uint8_t *lit, int len,
+                             int match) {
+  *op++ = (len >= 15 ? 15 : len) << 4 | (match >= 15 ? 15 : match);
+  if (len >= 15)
+    op = put_length(op, len - 15);
+  memcpy(op, lit, len);
+  return op + len;
+}
+
+// Returns the compressed size, or 0 if it would exceed cap
+int lz_compress(const uint8_t *src, int len, uint8_t *dst, int cap) {
+  uint32_t table[1 << HASH_BITS] = {0}; // position + 1, 0 = empty
+  const uint8_t *ip = src;
+  const uint8_t *anchor = src;
+  const uint8_t *end = src + len;
+  uint8_t *op = dst;
+  uint8_t *oend = dst + cap;
+
+  while (end - ip >= MIN_MATCH) {
+    uint32_t v = read32(ip);
+    uint32_t h = hash(v);
+    uint32_t prev = table[h];
+    table[h] = ip - src + 1;
+    if (!prev || ip - src - (prev - 1) > MAX_OFFSET ||
+        read32(src + prev - 1) != v) {
+      // Skip faster through data that isn't matching, stopping short of
+      // the end rather than stepping past it
+      int step = 1 + ((ip - anchor) >> 6);
+      if (step > end - ip - MIN_MATCH)
+        break;
+      ip += step;
+      continue;
+    }
+
+    // Extend the match a word at a time; the first differing byte is the
+    // lowest set byte of the XOR on a little-endian machine
+    const uint8_t *ref = src + prev - 1;
+    const uint8_t *m = ip + MIN_MATCH;
+    int delta = ip - ref;
+    uint64_t diff = 0;
+    while (end - m >= 8 && !(diff = read64(m) ^ read64(m - delta)))
+      m += 8;
+    if (diff)
+      m += __builtin_ctzll(diff) >> 3;
+    else
+      while (m < end && *m == m[-delta])
+        m++;
+    int lit = ip - anchor;
+    int match = m - ip - MIN_MATCH;
+    if (oend - op < 1 + lit / 255 + 1 + lit + 2 + match / 255 + 1)
+      return 0;
+    op = put_literals(op, anchor, lit, match);
+    *op++ = delta & 0xff;
+    *op++ = delta >> 8;
+    if (match >= 15)
+      op = put_length(op, match - 15);
+    ip = anchor = m;
+  }
+
+  int lit = end - anchor;
+  if (oend - op < 1 + lit / 255 + 1 + lit)
+    return 0;
+  op = put_literals(op, anchor, lit, 0);
+  return op - dst;
+}
+
+static int get_length(const uint8_t **ip, const uint8_t *iend) {
+  int len = 0;
+  uint8_t b;
+  do {
+    if (*ip >= iend)
+      return -1;
+    b = *(*ip)++;
+    len += b;
+  } while (b == 255);
+  return len;
+}
+
+// Returns the decompressed size, or -1 if src is malformed or the output
+// would exceed cap
+int lz_decompress(const uint8_t *src, int len, uint8_t *dst, int cap) {
+  const uint8_t *ip = src;
+  const uint8_t *iend = src + len;
+  uint8_t *op = dst;
+  uint8_t *oend = dst + cap;
+
+  while (ip < iend) {
+    int token = *ip++;
+    int lit = token >> 4;
+    if (lit == 15) {
+      int extra = get_length(&ip, iend);
+      if (extra < 0)
+        return -1;
+      lit += extra;
+    }
+    if (lit > iend - ip || lit > oend - op)
+      return -1;
+    memcpy(op, ip, lit);
+    op += lit;
+    ip += lit;
+    if (ip == iend)
+      break;
+
+    if (iend - ip < 2)
+      return -1;
+    int offset = ip[0] | ip[1] << 8;
+    ip += 2;
+    int match = token & 15;
+    if (match == 15) {
+      int extra = get_length(&ip, iend);
+      if (extra < 0)
+        return -1;
+      match += extra;
+    }
+    match += MIN_MATCH;
+    if (offset == 0 || offset > op - dst || match > oend - op)
+      return -1;
+    const uint8_t *ref = op - offset;
+    if (offset >= match) {
+      memcpy(op, ref, match);
+    } else {
+      for (int i = 0; i < match; i++)
+        op[i] = ref[i];
+    }
+    op += match;
+  }
+  return op - dst;
+}
@@ -0,0 +1,9 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdint.h>
+
+int lz_compress(const uint8_t *src, int len, uint8_t *dst, int cap);
+int lz_decompress(const uint8_t *src, int len, uint8_t *dst, int cap);
+
+#endif
@@ -1,7 +1,10 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "cluster.h"
 #include "render.h"
+#include "screen.h"
+#include "scrollback.h"
 
 void init_colors(GuiContext *gui, Args *args) {
   Colormap colormap = gui->x11.colormap;
@@ -207,23 +210,25 @@ XftColor *get_xft_color(GuiContext *gui, Term_Color color) {
   return &gui->color.xft_white;
 }
 
-static bool cell_in_selection(GuiContext *gui, int x, int y) {
+// Orders the selection's endpoints. Returns false if there is none.
+static bool selection_bounds(GuiContext *gui, int *start_x, int *start_y,
+                             int *end_x, int *end_y) {
   if (!gui->selection.has_selection)
     return false;
   int ax = gui->selection.sel_anchor_x, ay = gui->selection.sel_anchor_y;
   int bx = gui->selection.sel_cur_x, by = gui->selection.sel_cur_y;
+  bool forward = ay < by || (ay == by && ax <= bx);
+  *start_x = forward ? ax : bx;
+  *start_y = forward ? ay : by;
+  *end_x = forward ? bx : ax;
+  *end_y = forward ? by : ay;
+  return true;
+}
+
+static bool cell_in_selection(GuiContext *gui, int x, int y) {
   int start_x, start_y, end_x, end_y;
-  if (ay < by || (ay == by && ax <= bx)) {
-    start_x = ax;
-    start_y = ay;
-    end_x = bx;
-    end_y = by;
-  } else {
-    start_x = bx;
-    start_y = by;
-    end_x = ax;
-    end_y = ay;
-  }
+  if (!selection_bounds(gui, &start_x, &start_y, &end_x, &end_y))
+    return false;
   if (y < start_y || y > end_y)
     return false;
   if (y == start_y && x < start_x)
@@ -233,6 +238,19 @@ static bool cell_in_selection(GuiContext *gui, int x, int y) {
   return true;
 }
 
+// Returns the cells of row combined, counting scrollback rows first.
+// Scrollback lines are expanded into buf, which holds width cells; rows past
+// the top of the scrollback or past a line's width come back blank.
+static const Term_Cell *row_cells(Term_Screen *scr, int width, int combined,
+                                  Term_Cell *buf) {
+  Term_Scrollback *sb = &scr->scrollback;
+  if (combined >= sb->count)
+    return screen_line(scr, combined - sb->count);
+  int n = combined < 0 ? 0 : scrollback_line(sb, combined, buf, width);
+  memset(buf + n, 0, (width - n) * sizeof(Term_Cell));
+  return buf;
+}
+
 void build_selection_text(GuiContext *gui, Terminal *terminal) {
   free(gui->selection.selection_text);
   gui->selection.selection_text = NULL;
@@ -257,39 +275,40 @@ void build_selection_text(GuiContext *gui, Terminal *terminal) {
 
   Term_Screen *scr =
       terminal->screens.using_alt_screen ? &terminal->screens.alt_screen : &terminal->screens.screen;
-  Term_Scrollback *sb = &scr->scrollback;
 
-  int max_len = (terminal->dims.width * 6 + 1) * (end_y - start_y + 1) + 1;
+  int max_len = (terminal->dims.width * CELL_TEXT_MAX + 1) * (end_y - start_y + 1) + 1;
   char *buf = malloc(max_len);
-  if (!buf)
+  Term_Cell *row_buf = malloc(terminal->dims.width * sizeof(Term_Cell));
+  if (!buf || !row_buf) {
+    free(buf);
+    free(row_buf);
     return;
+  }
   int pos = 0;
 
   for (int combined = start_y; combined <= end_y; combined++) {
     int x0 = (combined == start_y) ? start_x : 0;
     int x1 = (combined == end_y) ? end_x : terminal->dims.width - 1;
+    bool wrapped = false;
+    const Term_Cell *cells =
+        row_cells(scr, terminal->dims.width, combined, row_buf);
 
     for (int x = x0; x <= x1; x++) {
-      Term_Cell cell;
-      if (combined < 0) {
-        memset(&cell, 0, sizeof(Term_Cell));
-      } else if (combined < sb->count) {
-        int idx = (sb->head + combined) % sb->capacity;
-        cell = (x < sb->widths[idx]) ? sb->lines[idx][x] : (Term_Cell){0};
-      } else {
-        cell = scr->lines[combined - sb->count].cells[x];
-      }
-      if (cell.length > 0) {
-        memcpy(buf + pos, cell.data, cell.length);
-        pos += cell.length;
-      } else {
+      Term_Cell cell = cells[x];
+      wrapped = cell.flags & CELL_WRAP;
+      if (cell.flags & CELL_WIDE_CONT)
+        continue;
+      if (cell.cp != 0)
+        pos += cell_text(&terminal->clusters, cell, buf + pos);
+      else
         buf[pos++] = ' ';
-      }
     }
-    if (combined < end_y)
+    // Rows joined by autowrap are one logical line
+    if (combined < end_y && !(wrapped && x1 == terminal->dims.width - 1))
       buf[pos++] = '\n';
   }
 
+  free(row_buf);
   buf[pos] = '\0';
   gui->selection.selection_text = buf;
   gui->selection.selection_len = pos;
@@ -303,26 +322,26 @@ void run_search(GuiContext *gui, Terminal *terminal) {
 
   Term_Screen *scr =
       terminal->screens.using_alt_screen ? &terminal->screens.alt_screen : &terminal->screens.screen;
-  Term_Scrollback *sb = &scr->scrollback;
-  int total_rows = sb->count + terminal->dims.height;
+  int total_rows = scr->scrollback.count + terminal->dims.height;
+  Term_Cell *row_buf = malloc(terminal->dims.width * sizeof(Term_Cell));
+  if (!row_buf)
+    return;
 
   for (int row = 0; row < total_rows; row++) {
     char buf[4096];
     int col_at_byte[4096];
     int buf_len = 0;
+    const Term_Cell *cells =
+        row_cells(scr, terminal->dims.width, row, row_buf);
 
-    for (int x = 0; x < terminal->dims.width && buf_len < (int)sizeof(buf) - 7;
+    for (int x = 0; x < terminal->dims.width &&
+                    buf_len < (int)sizeof(buf) - CELL_TEXT_MAX - 1;
          x++) {
-      Term_Cell cell;
-      if (row < sb->count) {
-        int idx = (sb->head + row) % sb->capacity;
-        cell = (x < sb->widths[idx]) ? sb->lines[idx][x] : (Term_Cell){0};
-      } else {
-        cell = scr->lines[row - sb->count].cells[x];
-      }
-      for (int k = 0; k < cell.length && buf_len < (int)sizeof(buf) - 1; k++) {
+      char text[CELL_TEXT_MAX];
+      int text_len = cell_text(&terminal->clusters, cells[x], text);
+      for (int k = 0; k < text_len; k++) {
         col_at_byte[buf_len] = x;
-        buf[buf_len++] = cell.data[k];
+        buf[buf_len++] = text[k];
       }
     }
     buf[buf_len] = '\0';
@@ -347,6 +366,7 @@ void run_search(GuiContext *gui, Terminal *terminal) {
       p = found + gui->search.search_query_len;
     }
   }
+  free(row_buf);
 
   // Focus first match at or after the current scroll position
   if (gui->search.search_match_count > 0) {
@@ -388,29 +408,443 @@ static void bg_fill(GuiContext *gui, int x, int y, int w, int h,
   }
 }
 
+// Glyphs of one colour waiting to be drawn with a single
+// XftDrawGlyphFontSpec call, each at its cell's position
+typedef struct {
+  XftGlyphFontSpec *specs;
+  int count, size;
+  XftColor color;
+} GlyphRun;
+
+static void flush_glyphs(GuiContext *gui, GlyphRun *run) {
+  if (run->count > 0)
+    XftDrawGlyphFontSpec(gui->color.xft_draw, &run->color, run->specs,
+                         run->count);
+  run->count = 0;
+}
+
+// Glyph index of cp in the regular (0), bold (1) or italic (2) font, from a
+// direct-mapped cache in front of XftCharIndex
+static FT_UInt glyph_index(GuiContext *gui, XftFont *font, int style,
+                           uint32_t cp) {
+  uint32_t key = cp << 2 | style;
+  GuiGlyph *slot =
+      &gui->fonts.glyph_cache[(key * 2654435761u) >> 20 & (GLYPH_CACHE_SIZE - 1)];
+  if (slot->key != key) {
+    slot->key = key;
+    slot->glyph = XftCharIndex(gui->x11.display, font, cp);
+  }
+  return slot->glyph;
+}
+
+// Queues a glyph, drawing the run first if it is full or has another colour
+static void queue_glyph(GuiContext *gui, GlyphRun *run, const XftColor *color,
+                        XftFont *font, int style, uint32_t cp, int x, int y) {
+  if (run->count == run->size ||
+      (run->count > 0 && memcmp(&run->color, color, sizeof(*color)) != 0))
+    flush_glyphs(gui, run);
+  run->color = *color;
+  run->specs[run->count++] = (XftGlyphFontSpec){
+      .font = font, .glyph = glyph_index(gui, font, style, cp), .x = x, .y = y};
+}
+
 // When using an ARGB visual, XFillRectangle/XDrawLine foreground pixels must
 // have 0xFF in the alpha byte or they render as transparent.
 static unsigned long opaque_pixel(GuiContext *gui, unsigned long pixel) {
   return (gui->surface.alpha < 255) ? (0xFF000000UL | (pixel & 0xFFFFFF)) : pixel;
 }
 
+static void damage_span(int *x0, int *x1, int y, int from, int to) {
+  if (from < x0[y])
+    x0[y] = from;
+  if (to > x1[y])
+    x1[y] = to;
+}
+
+// Damages whole rows top..bot, clipped to the window
+static void damage_rows(int *x0, int *x1, int top, int bot, int width,
+                        int height) {
+  for (int y = top < 0 ? 0 : top; y <= bot && y < height; y++)
+    damage_span(x0, x1, y, 0, width - 1);
+}
+
+// Background rectangles waiting to be filled, one request per colour
+typedef struct {
+  unsigned long rgb;
+  int alpha;
+  XRectangle rect;
+} BgRect;
+
+typedef struct {
+  BgRect *rects;
+  int count, size;
+} RectBatch;
+
+static int compare_bg_rects(const void *a, const void *b) {
+  const BgRect *ra = a, *rb = b;
+  if (ra->rgb != rb->rgb)
+    return ra->rgb < rb->rgb ? -1 : 1;
+  return ra->alpha - rb->alpha;
+}
+
+// Fills the queued rectangles, sorted so that each colour goes out as one
+// XFillRectangles or XRenderFillRectangles request. The rectangles never
+// overlap, so their order doesn't matter.
+static void flush_rects(GuiContext *gui, RectBatch *batch) {
+  qsort(batch->rects, batch->count, sizeof(BgRect), compare_bg_rects);
+  XRectangle *group = malloc(batch->count * sizeof(XRectangle));
+  for (int i = 0, n = 0; group && i < batch->count; i += n) {
+    const BgRect *first = &batch->rects[i];
+    for (n = 0; i + n < batch->count && batch->rects[i + n].rgb == first->rgb &&
+                batch->rects[i + n].alpha == first->alpha;
+         n++)
+      group[n] = batch->rects[i + n].rect;
+    if (gui->surface.alpha == 255) {
+      XSetForeground(gui->x11.display, gui->x11.gc, first->rgb);
+      XFillRectangles(gui->x11.display, gui->surface.backbuffer, gui->x11.gc, group, n);
+    } else {
+      XRenderColor xrc = {
+          .red = (unsigned short)(((first->rgb >> 16) & 0xFF) * 257),
+          .green = (unsigned short)(((first->rgb >> 8) & 0xFF) * 257),
+          .blue = (unsigned short)((first->rgb & 0xFF) * 257),
+          .alpha = (unsigned short)(first->alpha * 257),
+      };
+      XRenderFillRectangles(gui->x11.display, PictOpSrc,
+                            gui->surface.backbuffer_picture, &xrc, group, n);
+    }
+  }
+  free(group);
+  batch->count = 0;
+}
+
+// Queues a background rectangle, extending the previous one when it
+// continues the same run of colour along a row
+static void queue_rect(GuiContext *gui, RectBatch *batch, unsigned long rgb,
+                       int alpha, int x, int y, int w, int h) {
+  if (batch->count > 0) {
+    BgRect *last = &batch->rects[batch->count - 1];
+    if (last->rgb == rgb && last->alpha == alpha && last->rect.y == y &&
+        last->rect.x + last->rect.width == x) {
+      last->rect.width += w;
+      return;
+    }
+  }
+  if (batch->count == batch->size)
+    flush_rects(gui, batch);
+  batch->rects[batch->count++] = (BgRect){
+      .rgb = rgb, .alpha = alpha, .rect = {.x = x, .y = y, .width = w, .height = h}};
+}
+
+// How a cell is drawn once search highlights, the selection, the cursor and
+// reverse video are applied
+typedef struct {
+  unsigned long bg;
+  bool default_bg;
+  unsigned long text; // underline and strikethrough
+  XftColor glyph;
+  bool cursor;
+  bool block_cursor;
+} CellLook;
+
+static void cell_look(GuiContext *gui, Terminal *terminal,
+                      const Term_Screen *scr, Term_Cell cell, int x, int y,
+                      int combined, CellLook *look) {
+  const Term_Attr *attr = &terminal->attrs.attrs[cell.attr];
+  bool is_default_bg = (attr->bg.type == COLOR_DEFAULT && attr->bg.color == 0);
+  unsigned long bg_color = gui->color.default_bg;
+  if (!is_default_bg) {
+    bg_color = get_color_pixel(gui, attr->bg);
+  }
+
+  if (gui->search.search_active) {
+    for (int m = 0; m < gui->search.search_match_count; m++) {
+      if (gui->search.search_rows[m] > combined)
+        break;
+      if (gui->search.search_rows[m] == combined &&
+          gui->search.search_start_cols[m] <= x && x <= gui->search.search_end_cols[m]) {
+        Term_Color hc;
+        hc.type = COLOR_RGB;
+        if (m == gui->search.search_current) {
+          hc.rgb = (Term_RGB){255, 165, 0}; // orange: focused match
+        } else {
+          hc.rgb = (Term_RGB){160, 120, 0}; // dark gold: other matches
+        }
+        bg_color = get_color_pixel(gui, hc);
+        is_default_bg = false;
+        break;
+      }
+    }
+  }
+
+  look->cursor = gui->cursor.cursor_visible && !scr->cursor_hidden &&
+                 (scr->scroll_offset == 0) &&
+                 (scr->cursor.x == x && scr->cursor.y == y);
+  look->block_cursor = look->cursor && (terminal->modes.cursor_shape <= 2);
+  bool in_selection = cell_in_selection(gui, x, combined);
+  bool reverse = attr->reverse || look->block_cursor || in_selection;
+
+  if (reverse)
+    is_default_bg = false;
+
+  bool default_fg = attr->fg.type == COLOR_DEFAULT && attr->fg.color == 0;
+  unsigned long fg_pixel =
+      default_fg ? gui->color.default_fg : get_color_pixel(gui, attr->fg);
+  if (reverse) {
+    look->text = bg_color;
+    bg_color = fg_pixel;
+  } else {
+    look->text = fg_pixel;
+  }
+  look->bg = bg_color;
+  look->default_bg = is_default_bg;
+
+  if (cell.cp == 0)
+    return;
+  if (reverse) {
+    look->glyph = (attr->bg.type != COLOR_DEFAULT || attr->bg.color != 0)
+                      ? *get_xft_color(gui, attr->bg)
+                      : gui->color.xft_default_bg;
+  } else {
+    look->glyph = default_fg ? gui->color.xft_default_fg
+                             : *get_xft_color(gui, attr->fg);
+  }
+  if (attr->dim && !reverse) {
+    look->glyph.color.red >>= 1;
+    look->glyph.color.green >>= 1;
+    look->glyph.color.blue >>= 1;
+  }
+}
+
+// The cell the cursor is drawn on, or -1, -1 if it isn't drawn
+static void drawn_cursor(GuiContext *gui, Terminal *terminal,
+                         const Term_Screen *scr, int *x, int *y) {
+  *x = *y = -1;
+  if (gui->cursor.cursor_visible && !scr->cursor_hidden &&
+      scr->scroll_offset == 0) {
+    *x = scr->cursor.x < terminal->dims.width ? scr->cursor.x
+                                              : terminal->dims.width - 1;
+    *y = scr->cursor.y;
+  }
+}
+
+// Pixel columns px0..px1 (exclusive) covered by cells x0..x1 of a row.
+// Spans reaching either edge take in the margin there.
+static void span_pixels(GuiContext *gui, int width, int x0, int x1, int *px0,
+                        int *px1) {
+  *px0 = x0 == 0 ? 0 : x0 * gui->fonts.char_width + gui->surface.margin;
+  *px1 = x1 == width - 1 ? gui->surface.window_width
+                         : (x1 + 1) * gui->fonts.char_width + gui->surface.margin;
+}
+
+// Works out how the rows already on the backbuffer moved since the last
+// frame: with the screen's scroll region while the live screen is shown, or
+// as a whole when the viewport moved through the scrollback. Returns false
+// if they can't be moved and everything must be repainted.
+static bool frame_move(GuiContext *gui, Terminal *terminal,
+                       const Term_Screen *scr, Term_Damage *move) {
+  GuiFrame *frame = &gui->frame;
+  int height = terminal->dims.height;
+  int offset = scr->scroll_offset;
+  *move = (Term_Damage){0};
+  if (scr->damage.scroll) {
+    // Margin marks belong to scrollback rows, so they only move with the
+    // screen when all of it scrolls into the scrollback
+    bool whole = scr->damage.scroll_top == 0 &&
+                 scr->damage.scroll_bot == height - 1 &&
+                 scr->scrollback.capacity > 0 && scr->damage.scroll > 0;
+    bool marks = gui->surface.margin >= 4 && terminal->marks.shell_mark_count;
+    if (offset != 0 || frame->scroll_offset != 0 || frame->has_selection ||
+        (marks && !whole))
+      return false;
+    *move = scr->damage;
+  } else if (offset != frame->scroll_offset) {
+    int shift = frame->scroll_offset - offset;
+    if (scr->scrollback.count != frame->scrollback_count ||
+        abs(shift) >= height)
+      return false;
+    *move = (Term_Damage){.scroll = shift, .scroll_bot = height - 1};
+  }
+  return true;
+}
+
+// Damages the cells that show blinking text, for a change of blink phase.
+// Cells whose content changed are damaged already; the rest still show what
+// they hold now. Also notes whether any blinking text is left on screen.
+static void damage_blink(GuiContext *gui, Terminal *terminal, Term_Screen *scr,
+                         int *x0, int *x1) {
+  int width = terminal->dims.width;
+  int height = terminal->dims.height;
+  Term_Cell *row_buf = malloc(width * sizeof(Term_Cell));
+  if (!row_buf) {
+    damage_rows(x0, x1, 0, height - 1, width, height);
+    return;
+  }
+  bool has_blink = false;
+  for (int y = 0; y < height; y++) {
+    int combined = scr->scrollback.count - scr->scroll_offset + y;
+    const Term_Cell *cells = row_cells(scr, width, combined, row_buf);
+    for (int x = 0; x < width; x++)
+      if (cells[x].cp != 0 && terminal->attrs.attrs[cells[x].attr].blink) {
+        damage_span(x0, x1, y, x, x);
+        has_blink = true;
+      }
+  }
+  free(row_buf);
+  gui->frame.has_blink = has_blink;
+}
+
+// Fills x0/x1 with the columns of each visible row that must be repainted:
+// the terminal's own damage, plus whatever the cursor, selection and blinking
+// have changed since the last frame, once the rows in move have been moved.
+// Returns true if everything must be repainted.
+static bool frame_damage(GuiContext *gui, Terminal *terminal,
+                         Term_Screen *scr, int *x0, int *x1,
+                         Term_Damage *move) {
+  GuiFrame *frame = &gui->frame;
+  int width = terminal->dims.width;
+  int height = terminal->dims.height;
+  int offset = scr->scroll_offset;
+  bool blink_changed =
+      frame->has_blink && frame->blink_visible != gui->cursor.cursor_visible;
+  if (frame->full || frame->screen != scr ||
+      frame->bell_flash != gui->bell.bell_flash || gui->search.search_active ||
+      frame->search_active || scr->damage.all ||
+      frame->mark_count != terminal->marks.shell_mark_count ||
+      frame->mark_head != terminal->marks.shell_mark_head ||
+      !frame_move(gui, terminal, scr, move))
+    return true;
+
+  for (int y = 0; y < height; y++) {
+    x0[y] = width;
+    x1[y] = -1;
+    // Screen row y - offset is drawn at y while scrolled back
+    if (y >= offset)
+      row_damage(scr, y - offset, width, &x0[y], &x1[y]);
+  }
+
+  // Rows the viewport moved onto. The screen's own exposed rows are damaged
+  // when they are cleared.
+  if (move->scroll && !scr->damage.scroll) {
+    if (move->scroll > 0)
+      damage_rows(x0, x1, height - move->scroll, height - 1, width, height);
+    else
+      damage_rows(x0, x1, 0, -move->scroll - 1, width, height);
+  }
+
+  int cursor_x, cursor_y;
+  drawn_cursor(gui, terminal, scr, &cursor_x, &cursor_y);
+  if (cursor_x != frame->cursor_x || cursor_y != frame->cursor_y ||
+      terminal->modes.cursor_shape != frame->cursor_shape || move->scroll) {
+    int old_y = frame->cursor_y;
+    if (old_y >= 0 && old_y < height && frame->cursor_x < width) {
+      damage_span(x0, x1, old_y, frame->cursor_x, frame->cursor_x);
+      // The old cursor's pixels move with its row
+      if (old_y >= move->scroll_top && old_y <= move->scroll_bot &&
+          old_y - move->scroll >= move->scroll_top &&
+          old_y - move->scroll <= move->scroll_bot)
+        damage_span(x0, x1, old_y - move->scroll, frame->cursor_x,
+                    frame->cursor_x);
+    }
+    if (cursor_y >= 0)
+      damage_span(x0, x1, cursor_y, cursor_x, cursor_x);
+  }
+
+  int sx0 = 0, sy0 = 0, sx1 = 0, sy1 = 0;
+  bool has_selection = selection_bounds(gui, &sx0, &sy0, &sx1, &sy1);
+  if (has_selection != frame->has_selection ||
+      (has_selection &&
+       (sx0 != frame->sel_start_x || sy0 != frame->sel_start_y ||
+        sx1 != frame->sel_end_x || sy1 != frame->sel_end_y))) {
+    int top = scr->scrollback.count - offset;
+    if (frame->has_selection)
+      damage_rows(x0, x1, frame->sel_start_y - top, frame->sel_end_y - top,
+                  width, height);
+    if (has_selection)
+      damage_rows(x0, x1, sy0 - top, sy1 - top, width, height);
+  }
+
+  if (blink_changed)
+    damage_blink(gui, terminal, scr, x0, x1);
+  return false;
+}
+
 void draw_terminal(GuiContext *gui, Terminal *terminal) {
   Term_Screen *term_screen =
       terminal->screens.using_alt_screen ? &terminal->screens.alt_screen : &terminal->screens.screen;
+  int width = terminal->dims.width;
+  int height = terminal->dims.height;
+  int *span = malloc(2 * height * sizeof(int));
+  if (!span)
+    return;
+  int *span_x0 = span, *span_x1 = span + height;
+  Term_Damage move;
+  bool full =
+      frame_damage(gui, terminal, term_screen, span_x0, span_x1, &move);
 
-  // Clear entire backbuffer: transparent bg, or opaque fg during bell flash
-  if (gui->bell.bell_flash) {
-    bg_fill(gui, 0, 0, gui->surface.window_width, gui->surface.window_height, gui->color.default_fg,
-            255);
-  } else {
-    bg_fill(gui, 0, 0, gui->surface.window_width, gui->surface.window_height, gui->color.default_bg,
-            gui->surface.alpha);
+  // Move rows that are still valid with one copy within the backbuffer
+  int ch = gui->fonts.char_height;
+  if (!full && move.scroll) {
+    int rows = move.scroll_bot - move.scroll_top + 1 - abs(move.scroll);
+    int dst = move.scroll_top + (move.scroll < 0 ? -move.scroll : 0);
+    XCopyArea(gui->x11.display, gui->surface.backbuffer, gui->surface.backbuffer,
+              gui->x11.gc, 0, (dst + move.scroll) * ch + gui->surface.margin,
+              gui->surface.window_width, rows * ch, 0, dst * ch + gui->surface.margin);
+  }
+
+  if (full) {
+    // Clear entire backbuffer: transparent bg, or opaque fg during bell flash
+    if (gui->bell.bell_flash) {
+      bg_fill(gui, 0, 0, gui->surface.window_width, gui->surface.window_height,
+              gui->color.default_fg, 255);
+    } else {
+      bg_fill(gui, 0, 0, gui->surface.window_width, gui->surface.window_height,
+              gui->color.default_bg, gui->surface.alpha);
+    }
+    for (int y = 0; y < height; y++) {
+      span_x0[y] = 0;
+      span_x1[y] = width - 1;
+    }
+    gui->frame.has_blink = false;
   }
 
   int scroll_offset = term_screen->scroll_offset;
   Term_Scrollback *sb = &term_screen->scrollback;
+  Term_Cell *row_buf = malloc(terminal->dims.width * sizeof(Term_Cell));
+  GlyphRun run = {.specs = malloc(width * sizeof(XftGlyphFontSpec)),
+                  .size = width};
+  RectBatch rects = {.rects = malloc(4 * width * sizeof(BgRect)),
+                     .size = 4 * width};
+  if (!row_buf || !run.specs || !rects.rects) {
+    free(row_buf);
+    free(run.specs);
+    free(rects.rects);
+    free(span);
+    return;
+  }
 
+  // Backgrounds first, batched by colour across the whole frame, then text
   for (int y = 0; y < terminal->dims.height; y++) {
+    if (span_x0[y] > span_x1[y])
+      continue;
+    int combined = sb->count - scroll_offset + y;
+    const Term_Cell *cells =
+        row_cells(term_screen, terminal->dims.width, combined, row_buf);
+
+    // Widen the span to whole wide characters and clear it
+    int x0 = span_x0[y], x1 = span_x1[y];
+    if (x0 > 0 && (cells[x0].flags & CELL_WIDE_CONT))
+      x0--;
+    if (x1 < width - 1 && (cells[x1].flags & CELL_WIDE))
+      x1++;
+    span_x0[y] = x0;
+    span_x1[y] = x1;
+    if (!full) {
+      int px0, px1;
+      span_pixels(gui, width, x0, x1, &px0, &px1);
+      bg_fill(gui, px0, y * gui->fonts.char_height + gui->surface.margin,
+              px1 - px0, gui->fonts.char_height, gui->color.default_bg,
+              gui->surface.alpha);
+    }
     if (gui->surface.margin >= 4) {
       int combined_row = sb->count - scroll_offset + y;
       int oldest = sb->count - sb->capacity;
@@ -431,126 +865,77 @@ void draw_terminal(GuiContext *gui, Terminal *terminal) {
       }
     }
 
-    for (int x = 0; x < terminal->dims.width; x++) {
-      Term_Cell cell;
-      int combined = sb->count - scroll_offset + y;
-      if (combined < 0) {
-        memset(&cell, 0, sizeof(Term_Cell));
-      } else if (combined < sb->count) {
-        int idx = (sb->head + combined) % sb->capacity;
-        cell = (x < sb->widths[idx]) ? sb->lines[idx][x] : (Term_Cell){0};
-      } else {
-        cell = term_screen->lines[combined - sb->count].cells[x];
-      }
-
-      if (cell.wide_cont)
+    for (int x = x0; x <= x1; x++) {
+      Term_Cell cell = cells[x];
+      if (cell.flags & CELL_WIDE_CONT)
         continue;
+      CellLook look;
+      cell_look(gui, terminal, term_screen, cell, x, y, combined, &look);
+      // Default-bg cells are already painted by the clear, except during a
+      // bell flash
+      if (look.default_bg && !gui->bell.bell_flash)
+        continue;
+      int draw_width = (cell.flags & CELL_WIDE) ? gui->fonts.char_width * 2 : gui->fonts.char_width;
+      queue_rect(gui, &rects, look.bg, look.default_bg ? gui->surface.alpha : 255,
+                 x * gui->fonts.char_width + gui->surface.margin,
+                 y * gui->fonts.char_height + gui->surface.margin, draw_width,
+                 gui->fonts.char_height);
+    }
+  }
+  flush_rects(gui, &rects);
 
-      int pixel_x = x * gui->fonts.char_width + gui->surface.margin;
-      int pixel_y = y * (gui->fonts.char_height) + gui->surface.margin;
-      int draw_width = cell.wide ? gui->fonts.char_width * 2 : gui->fonts.char_width;
-
-      bool is_default_bg =
-          (cell.attr.bg.type == COLOR_DEFAULT && cell.attr.bg.color == 0);
-      unsigned long bg_color = gui->color.default_bg;
-      if (!is_default_bg) {
-        bg_color = get_color_pixel(gui, cell.attr.bg);
-      }
-
-      if (gui->search.search_active) {
-        for (int m = 0; m < gui->search.search_match_count; m++) {
-          if (gui->search.search_rows[m] > combined)
-            break;
-          if (gui->search.search_rows[m] == combined &&
-              gui->search.search_start_cols[m] <= x && x <= gui->search.search_end_cols[m]) {
-            Term_Color hc;
-            hc.type = COLOR_RGB;
-            if (m == gui->search.search_current) {
-              hc.rgb = (Term_RGB){255, 165, 0}; // orange: focused match
-            } else {
-              hc.rgb = (Term_RGB){160, 120, 0}; // dark gold: other matches
-            }
-            bg_color = get_color_pixel(gui, hc);
-            is_default_bg = false;
-            break;
-          }
-        }
-      }
-
-      bool is_cursor =
-          gui->cursor.cursor_visible && !term_screen->cursor_hidden &&
-          (scroll_offset == 0) &&
-          (term_screen->cursor.x == x && term_screen->cursor.y == y);
-      int cursor_shape = terminal->modes.cursor_shape;
-      bool is_block_cursor = is_cursor && (cursor_shape <= 2);
-      bool in_selection = cell_in_selection(gui, x, combined);
-      bool reverse = cell.attr.reverse || is_block_cursor || in_selection;
+  for (int y = 0; y < terminal->dims.height; y++) {
+    if (span_x0[y] > span_x1[y])
+      continue;
+    int combined = sb->count - scroll_offset + y;
+    const Term_Cell *cells =
+        row_cells(term_screen, terminal->dims.width, combined, row_buf);
 
-      if (reverse)
-        is_default_bg = false;
+    for (int x = span_x0[y]; x <= span_x1[y]; x++) {
+      Term_Cell cell = cells[x];
 
-      unsigned long text_color;
-      if (reverse) {
-        text_color = bg_color;
-        bg_color =
-            (cell.attr.fg.type != COLOR_DEFAULT || cell.attr.fg.color != 0)
-                ? get_color_pixel(gui, cell.attr.fg)
-                : gui->color.default_fg;
-      } else {
-        text_color =
-            (cell.attr.fg.type != COLOR_DEFAULT || cell.attr.fg.color != 0)
-                ? get_color_pixel(gui, cell.attr.fg)
-                : gui->color.default_fg;
-      }
+      if (cell.flags & CELL_WIDE_CONT)
+        continue;
+      const Term_Attr *attr = &terminal->attrs.attrs[cell.attr];
+      CellLook look;
+      cell_look(gui, terminal, term_screen, cell, x, y, combined, &look);
 
-      // Default-bg cells are already painted by the initial clear; only draw
-      // explicitly-colored backgrounds (and always opaque).
-      int cell_alpha = is_default_bg ? gui->surface.alpha : 255;
-      bg_fill(gui, pixel_x, pixel_y, draw_width, gui->fonts.char_height, bg_color,
-              cell_alpha);
+      int pixel_x = x * gui->fonts.char_width + gui->surface.margin;
+      int pixel_y = y * (gui->fonts.char_height) + gui->surface.margin;
+      int draw_width = (cell.flags & CELL_WIDE) ? gui->fonts.char_width * 2 : gui->fonts.char_width;
 
-      if (cell.length > 0) {
-        XftColor *fg_color;
-        XftFont *font_to_use = cell.attr.bold     ? gui->fonts.font_bold
-                               : cell.attr.italic ? gui->fonts.font_italic
+      if (cell.cp != 0) {
+        int style = attr->bold ? 1 : attr->italic ? 2 : 0;
+        XftFont *font_to_use = attr->bold     ? gui->fonts.font_bold
+                               : attr->italic ? gui->fonts.font_italic
                                                   : gui->fonts.font;
 
-        if (reverse) {
-          fg_color =
-              (cell.attr.bg.type != COLOR_DEFAULT || cell.attr.bg.color != 0)
-                  ? get_xft_color(gui, cell.attr.bg)
-                  : &gui->color.xft_default_bg;
-        } else {
-          fg_color =
-              (cell.attr.fg.type != COLOR_DEFAULT || cell.attr.fg.color != 0)
-                  ? get_xft_color(gui, cell.attr.fg)
-                  : &gui->color.xft_default_fg;
-        }
-
-        XftColor dim_color;
-        if (cell.attr.dim && !reverse) {
-          dim_color = *fg_color;
-          dim_color.color.red >>= 1;
-          dim_color.color.green >>= 1;
-          dim_color.color.blue >>= 1;
-          fg_color = &dim_color;
-        }
-
-        if (cell.attr.blink && !gui->cursor.cursor_visible)
+        if (attr->blink)
+          gui->frame.has_blink = true;
+        if (attr->blink && !gui->cursor.cursor_visible)
           goto skip_text;
 
-        XftDrawStringUtf8(gui->color.xft_draw, fg_color, font_to_use, pixel_x,
-                          pixel_y + gui->fonts.char_ascent, (FcChar8 *)cell.data,
-                          cell.length);
+        if (cell.flags & CELL_CLUSTER) {
+          // Let Xft place the combining marks
+          char text[CELL_TEXT_MAX];
+          int text_len = cell_text(&terminal->clusters, cell, text);
+          flush_glyphs(gui, &run);
+          XftDrawStringUtf8(gui->color.xft_draw, &look.glyph, font_to_use, pixel_x,
+                            pixel_y + gui->fonts.char_ascent, (FcChar8 *)text,
+                            text_len);
+        } else {
+          queue_glyph(gui, &run, &look.glyph, font_to_use, style, cell.cp,
+                      pixel_x, pixel_y + gui->fonts.char_ascent);
+        }
 
-        if (cell.attr.underline || cell.attr.uri_idx > 0) {
-          XSetForeground(gui->x11.display, gui->x11.gc, opaque_pixel(gui, text_color));
+        if (attr->underline || attr->uri_idx > 0) {
+          XSetForeground(gui->x11.display, gui->x11.gc, opaque_pixel(gui, look.text));
           XDrawLine(gui->x11.display, gui->surface.backbuffer, gui->x11.gc, pixel_x,
                     pixel_y + gui->fonts.char_height - 1, pixel_x + draw_width - 1,
                     pixel_y + gui->fonts.char_height - 1);
         }
-        if (cell.attr.strikethrough) {
-          XSetForeground(gui->x11.display, gui->x11.gc, opaque_pixel(gui, text_color));
+        if (attr->strikethrough) {
+          XSetForeground(gui->x11.display, gui->x11.gc, opaque_pixel(gui, look.text));
           XDrawLine(gui->x11.display, gui->surface.backbuffer, gui->x11.gc, pixel_x,
                     pixel_y + gui->fonts.char_ascent / 2, pixel_x + draw_width - 1,
                     pixel_y + gui->fonts.char_ascent / 2);
@@ -558,10 +943,11 @@ void draw_terminal(GuiContext *gui, Terminal *terminal) {
       skip_text:;
       }
 
-      if (is_cursor && !is_block_cursor) {
+      if (look.cursor && !look.block_cursor) {
+        flush_glyphs(gui, &run);
         XSetForeground(gui->x11.display, gui->x11.gc,
                        opaque_pixel(gui, gui->color.default_fg));
-        if (cursor_shape == 3 || cursor_shape == 4) {
+        if (terminal->modes.cursor_shape == 3 || terminal->modes.cursor_shape == 4) {
           XFillRectangle(gui->x11.display, gui->surface.backbuffer, gui->x11.gc, pixel_x,
                          pixel_y + gui->fonts.char_height - 2, draw_width, 2);
         } else {
@@ -571,6 +957,7 @@ void draw_terminal(GuiContext *gui, Terminal *terminal) {
       }
     }
   }
+  flush_glyphs(gui, &run);
 
   if (gui->search.search_active) {
     int bar_y = gui->surface.window_height - gui->fonts.char_height - gui->surface.margin;
@@ -595,6 +982,65 @@ void draw_terminal(GuiContext *gui, Terminal *terminal) {
                       blen > 0 ? blen : 0);
   }
 
-  XCopyArea(gui->x11.display, gui->surface.backbuffer, gui->x11.window, gui->x11.gc, 0, 0,
-            gui->surface.window_width, gui->surface.window_height, 0, 0);
+  free(row_buf);
+  free(run.specs);
+  free(rects.rects);
+  if (full) {
+    XCopyArea(gui->x11.display, gui->surface.backbuffer, gui->x11.window, gui->x11.gc, 0, 0,
+              gui->surface.window_width, gui->surface.window_height, 0, 0);
+  } else {
+    // One copy per band of consecutive repainted rows
+    for (int y = 0; y < height;) {
+      if (span_x0[y] > span_x1[y]) {
+        y++;
+        continue;
+      }
+      int top = y, x0 = span_x0[y], x1 = span_x1[y];
+      for (y++; y < height && span_x0[y] <= span_x1[y]; y++) {
+        if (span_x0[y] < x0)
+          x0 = span_x0[y];
+        if (span_x1[y] > x1)
+          x1 = span_x1[y];
+      }
+      int px0, px1;
+      span_pixels(gui, width, x0, x1, &px0, &px1);
+      int py = top * ch + gui->surface.margin;
+      XCopyArea(gui->x11.display, gui->surface.backbuffer, gui->x11.window, gui->x11.gc, px0,
+                py, px1 - px0, (y - top) * ch, px0, py);
+    }
+    if (move.scroll) {
+      int py = move.scroll_top * ch + gui->surface.margin;
+      XCopyArea(gui->x11.display, gui->surface.backbuffer, gui->x11.window, gui->x11.gc, 0,
+                py, gui->surface.window_width,
+                (move.scroll_bot - move.scroll_top + 1) * ch, 0, py);
+    }
+  }
+  free(span);
+
+  GuiFrame *frame = &gui->frame;
+  frame->full = false;
+  frame->screen = term_screen;
+  frame->scroll_offset = scroll_offset;
+  frame->scrollback_count = sb->count;
+  frame->bell_flash = gui->bell.bell_flash;
+  frame->search_active = gui->search.search_active;
+  frame->blink_visible = gui->cursor.cursor_visible;
+  drawn_cursor(gui, terminal, term_screen, &frame->cursor_x, &frame->cursor_y);
+  frame->cursor_shape = terminal->modes.cursor_shape;
+  frame->has_selection =
+      selection_bounds(gui, &frame->sel_start_x, &frame->sel_start_y,
+                       &frame->sel_end_x, &frame->sel_end_y);
+  frame->mark_count = terminal->marks.shell_mark_count;
+  frame->mark_head = terminal->marks.shell_mark_head;
+  clear_damage(term_screen, height);
+}
+
+// Repaints an exposed area from the backbuffer, which holds the last frame
+void expose_terminal(GuiContext *gui, Terminal *terminal, XExposeEvent *ev) {
+  if (gui->frame.full) {
+    draw_terminal(gui, terminal);
+    return;
+  }
+  XCopyArea(gui->x11.display, gui->surface.backbuffer, gui->x11.window, gui->x11.gc, ev->x,
+            ev->y, ev->width, ev->height, ev->x, ev->y);
 }
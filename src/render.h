@@ -9,6 +9,7 @@ void build_selection_text(GuiContext *gui, Terminal *terminal);
 unsigned long get_color_pixel(GuiContext *gui, Term_Color color);
 XftColor *get_xft_color(GuiContext *gui, Term_Color color);
 void draw_terminal(GuiContext *gui, Terminal *terminal);
+void expose_terminal(GuiContext *gui, Terminal *terminal, XExposeEvent *ev);
 void run_search(GuiContext *gui, Terminal *terminal);
 
 #endif
@@ -0,0 +1,168 @@
+#include <stdint.h>
+
+#include "scan.h"
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#define SCAN_SSE2 1
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCAN_AVX2 1
+#endif
+#endif
+
+static inline bool is_control(unsigned char c) { return c < 0x20 || c == 0x7f; }
+
+static inline bool is_string_end(unsigned char c) {
+  return c == 0x07 || c == 0x18 || c == 0x1a || c == 0x1b;
+}
+
+static int scan_text_scalar(const char *text, int length, int i, bool *ascii) {
+  unsigned char high = 0;
+  for (; i < length; i++) {
+    unsigned char c = (unsigned char)text[i];
+    if (is_control(c))
+      break;
+    high |= c;
+  }
+  if (high & 0x80)
+    *ascii = false;
+  return i;
+}
+
+static int scan_string_scalar(const char *text, int length, int i) {
+  while (i < length && !is_string_end((unsigned char)text[i]))
+    i++;
+  return i;
+}
+
+#ifdef SCAN_SSE2
+// Bytes <= 0x1f are the ones left unchanged by an unsigned max with 0x1f
+#define CONTROL_MASK(set1, max, cmpeq, or, v)                                 \
+  or(cmpeq(max(v, set1(0x1f)), set1(0x1f)), cmpeq(v, set1(0x7f)))
+
+static int scan_text_sse2(const char *text, int length, bool *ascii) {
+  int i = 0;
+  for (; i + 16 <= length; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(text + i));
+    uint32_t ctrl = _mm_movemask_epi8(CONTROL_MASK(
+        _mm_set1_epi8, _mm_max_epu8, _mm_cmpeq_epi8, _mm_or_si128, v));
+    uint32_t high = _mm_movemask_epi8(v);
+    if (ctrl) {
+      int n = __builtin_ctz(ctrl);
+      if (high & ((1u << n) - 1))
+        *ascii = false;
+      return i + n;
+    }
+    if (high)
+      *ascii = false;
+  }
+  return scan_text_scalar(text, length, i, ascii);
+}
+
+static int scan_string_sse2(const char *text, int length) {
+  int i = 0;
+  for (; i + 16 <= length; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(text + i));
+    __m128i m = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(0x07)),
+                     _mm_cmpeq_epi8(v, _mm_set1_epi8(0x18))),
+        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(0x1a)),
+                     _mm_cmpeq_epi8(v, _mm_set1_epi8(0x1b))));
+    uint32_t hit = _mm_movemask_epi8(m);
+    if (hit)
+      return i + __builtin_ctz(hit);
+  }
+  return scan_string_scalar(text, length, i);
+}
+#endif
+
+#ifdef SCAN_AVX2
+__attribute__((target("avx2"))) static int
+scan_text_avx2(const char *text, int length, bool *ascii) {
+  int i = 0;
+  for (; i + 32 <= length; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(text + i));
+    uint32_t ctrl = _mm256_movemask_epi8(
+        CONTROL_MASK(_mm256_set1_epi8, _mm256_max_epu8, _mm256_cmpeq_epi8,
+                     _mm256_or_si256, v));
+    uint32_t high = _mm256_movemask_epi8(v);
+    if (ctrl) {
+      int n = __builtin_ctz(ctrl);
+      if (n > 0 && (high << (32 - n)))
+        *ascii = false;
+      return i + n;
+    }
+    if (high)
+      *ascii = false;
+  }
+  return scan_text_scalar(text, length, i, ascii);
+}
+
+__attribute__((target("avx2"))) static int scan_string_avx2(const char *text,
+                                                             int length) {
+  int i = 0;
+  for (; i + 32 <= length; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(text + i));
+    __m256i m = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x07)),
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x18))),
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x1a)),
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x1b))));
+    uint32_t hit = _mm256_movemask_epi8(m);
+    if (hit)
+      return i + __builtin_ctz(hit);
+  }
+  return scan_string_scalar(text, length, i);
+}
+#endif
+
+static int scan_text_portable(const char *text, int length, bool *ascii) {
+  return scan_text_scalar(text, length, 0, ascii);
+}
+
+static int scan_string_portable(const char *text, int length) {
+  return scan_string_scalar(text, length, 0);
+}
+
+static int scan_text_resolve(const char *text, int length, bool *ascii);
+static int scan_string_resolve(const char *text, int length);
+
+// Both start out pointing at the resolver, which picks the widest kernel the
+// CPU supports on first use
+static int (*scan_text_impl)(const char *, int, bool *) = scan_text_resolve;
+static int (*scan_string_impl)(const char *, int) = scan_string_resolve;
+
+static void resolve(void) {
+  scan_text_impl = scan_text_portable;
+  scan_string_impl = scan_string_portable;
+#ifdef SCAN_SSE2
+  scan_text_impl = scan_text_sse2;
+  scan_string_impl = scan_string_sse2;
+#endif
+#ifdef SCAN_AVX2
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    scan_text_impl = scan_text_avx2;
+    scan_string_impl = scan_string_avx2;
+  }
+#endif
+}
+
+static int scan_text_resolve(const char *text, int length, bool *ascii) {
+  resolve();
+  return scan_text_impl(text, length, ascii);
+}
+
+static int scan_string_resolve(const char *text, int length) {
+  resolve();
+  return scan_string_impl(text, length);
+}
+
+int scan_text(const char *text, int length, bool *ascii) {
+  *ascii = true;
+  return scan_text_impl(text, length, ascii);
+}
+
+int scan_string(const char *text, int length) {
+  return scan_string_impl(text, length);
+}
@@ -0,0 +1,14 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stdbool.h>
+
+// Returns the offset of the first C0 control or DEL in text, or length if
+// there is none. *ascii is set when every byte before that offset is 7-bit.
+int scan_text(const char *text, int length, bool *ascii);
+
+// Returns the offset of the first byte that can end an OSC or DCS string
+// (BEL, CAN, SUB or ESC), or length if there is none.
+int scan_string(const char *text, int length);
+
+#endif
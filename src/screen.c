@@ -2,96 +2,22 @@
 #include <string.h>
 
 #include "screen.h"
+#include "scrollback.h"
 #include "terminal.h"
 
-static int utf8_decode(const char *s, int len) {
-  if (len <= 0)
-    return -1;
-  unsigned char c = (unsigned char)s[0];
-  if (c < 0x80)
-    return c;
-  if ((c & 0xE0) == 0xC0 && len >= 2)
-    return ((c & 0x1F) << 6) | ((unsigned char)s[1] & 0x3F);
-  if ((c & 0xF0) == 0xE0 && len >= 3)
-    return ((c & 0x0F) << 12) | (((unsigned char)s[1] & 0x3F) << 6) |
-           ((unsigned char)s[2] & 0x3F);
-  if ((c & 0xF8) == 0xF0 && len >= 4)
-    return ((c & 0x07) << 18) | (((unsigned char)s[1] & 0x3F) << 12) |
-           (((unsigned char)s[2] & 0x3F) << 6) | ((unsigned char)s[3] & 0x3F);
-  return -1;
-}
-
-static int is_wide_codepoint(int cp) {
-  if (cp < 0x1100)
-    return 0;
-  if (cp <= 0x115F)
-    return 1; // Hangul Jamo
-  if (cp < 0x2E80)
-    return 0;
-  if (cp <= 0x303E)
-    return 1; // CJK Radicals through CJK Symbols
-  if (cp < 0x3041)
-    return 0;
-  if (cp <= 0x33FF)
-    return 1; // Hiragana, Katakana, Bopomofo, CJK Compat
-  if (cp < 0x3400)
-    return 0;
-  if (cp <= 0x4DBF)
-    return 1; // CJK Extension A
-  if (cp < 0x4E00)
-    return 0;
-  if (cp <= 0x9FFF)
-    return 1; // CJK Unified Ideographs
-  if (cp < 0xA000)
-    return 0;
-  if (cp <= 0xA4CF)
-    return 1; // Yi
-  if (cp < 0xA960)
-    return 0;
-  if (cp <= 0xA97F)
-    return 1; // Hangul Jamo Extended-A
-  if (cp < 0xAC00)
-    return 0;
-  if (cp <= 0xD7AF)
-    return 1; // Hangul Syllables
-  if (cp < 0xF900)
-    return 0;
-  if (cp <= 0xFAFF)
-    return 1; // CJK Compatibility Ideographs
-  if (cp < 0xFE10)
-    return 0;
-  if (cp <= 0xFE6F)
-    return 1; // Vertical, CJK Compat, Small Forms
-  if (cp < 0xFF01)
-    return 0;
-  if (cp <= 0xFF60)
-    return 1; // Fullwidth ASCII and punctuation
-  if (cp < 0xFFE0)
-    return 0;
-  if (cp <= 0xFFE6)
-    return 1; // Fullwidth signs
-  if (cp < 0x1B000)
-    return 0;
-  if (cp <= 0x1B0FF)
-    return 1; // Kana Supplement
-  if (cp < 0x1F300)
-    return 0;
-  if (cp <= 0x1F9FF)
-    return 1; // Emoji and Misc Symbols
-  if (cp < 0x20000)
-    return 0;
-  if (cp <= 0x2FFFD)
-    return 1; // CJK Extension B–F
-  if (cp < 0x30000)
-    return 0;
-  if (cp <= 0x3FFFD)
-    return 1; // CJK Extension G
-  return 0;
+// Flags the last cell of the cursor's row as continuing onto the next one and
+// moves the cursor there
+static void autowrap(Term_Screen *screen, int width, int height) {
+  if (screen->cursor.y < height)
+    screen_line(screen, screen->cursor.y)[width - 1].flags |= CELL_WRAP;
+  handle_newline(screen, width, height);
+  screen->cursor.x = 0;
 }
 
 void init_screen(Term_Screen *screen, int width, int height,
                  int scrollback_lines) {
   memset(&screen->cursor, 0, sizeof(Term_Cursor));
+  memset(&screen->saved_cursor, 0, sizeof(Term_Cursor));
   screen->lines = (Term_Line *)malloc(height * sizeof(Term_Line));
   for (int i = 0; i < height; i++) {
     screen->lines[i].cells = (Term_Cell *)malloc(width * sizeof(Term_Cell));
@@ -99,28 +25,28 @@ void init_screen(Term_Screen *screen, int width, int height,
       memset(&screen->lines[i].cells[j], 0, sizeof(Term_Cell));
     }
   }
-  screen->scrollback.lines = malloc(scrollback_lines * sizeof(Term_Cell *));
-  screen->scrollback.widths = malloc(scrollback_lines * sizeof(int));
-  screen->scrollback.capacity = scrollback_lines;
-  screen->scrollback.count = 0;
-  screen->scrollback.head = 0;
+  screen->line_base = 0;
+  screen->line_count = height;
+  clear_damage(screen, height);
+  screen->damage.all = true;
+  init_scrollback(&screen->scrollback, scrollback_lines);
   screen->scroll_offset = 0;
   screen->scroll_top = 0;
   screen->scroll_bot = height - 1;
+  screen->cursor_hidden = false;
   screen->scrolled = false;
+  screen->ambiguous_wide = false;
 }
 
 void free_screen(Term_Screen *screen, int height) {
+  if (!screen->lines)
+    return;
   for (int i = 0; i < height; i++) {
     free(screen->lines[i].cells);
   }
   free(screen->lines);
-  for (int i = 0; i < screen->scrollback.count; i++) {
-    free(screen->scrollback.lines[(screen->scrollback.head + i) %
-                                  screen->scrollback.capacity]);
-  }
-  free(screen->scrollback.lines);
-  free(screen->scrollback.widths);
+  screen->lines = NULL;
+  free_scrollback(&screen->scrollback);
 }
 
 void reset_screen(Term_Screen *screen, int width, int height) {
@@ -129,49 +55,123 @@ void reset_screen(Term_Screen *screen, int width, int height) {
   for (int i = 0; i < height; i++)
     for (int j = 0; j < width; j++)
       memset(&screen->lines[i].cells[j], 0, sizeof(Term_Cell));
-  Term_Scrollback *sb = &screen->scrollback;
-  for (int i = 0; i < sb->count; i++)
-    free(sb->lines[(sb->head + i) % sb->capacity]);
-  sb->count = 0;
-  sb->head = 0;
+  clear_scrollback(&screen->scrollback);
   screen->scroll_offset = 0;
   screen->scroll_top = 0;
   screen->scroll_bot = height - 1;
   screen->cursor_hidden = false;
   screen->scrolled = false;
+  screen->damage.all = true;
 }
 
-void scroll_screen(Term_Screen *screen, int width, int height) {
-  (void)height;
-  int top = screen->scroll_top;
-  int bot = screen->scroll_bot;
+// Swaps rows a and b of the ring, given as ring indices
+static void swap_lines(Term_Screen *screen, int a, int b) {
+  Term_Line tmp = screen->lines[a];
+  screen->lines[a] = screen->lines[b];
+  screen->lines[b] = tmp;
+}
 
-  if (top == 0) {
-    Term_Scrollback *sb = &screen->scrollback;
-    int idx;
-    if (sb->count < sb->capacity) {
-      idx = (sb->head + sb->count) % sb->capacity;
-      sb->count++;
-    } else {
-      idx = sb->head;
-      free(sb->lines[idx]);
-      sb->head = (sb->head + 1) % sb->capacity;
-    }
-    sb->lines[idx] = malloc(width * sizeof(Term_Cell));
-    memcpy(sb->lines[idx], screen->lines[top].cells, width * sizeof(Term_Cell));
-    sb->widths[idx] = width;
+// Reverses the order of visible rows from..to
+static void reverse_lines(Term_Screen *screen, int from, int to) {
+  for (; from < to; from++, to--)
+    swap_lines(screen, (screen->line_base + from) % screen->line_count,
+               (screen->line_base + to) % screen->line_count);
+}
+
+// Adds a move of rows top..bot by n to the damage's scroll hint. Moves of
+// different regions can't be combined, and a move by the whole region
+// leaves nothing worth moving, so both fall back to a full redraw.
+static void damage_scroll(Term_Screen *screen, int top, int bot, int n) {
+  Term_Damage *damage = &screen->damage;
+  if (damage->all)
+    return;
+  if (damage->scroll == 0) {
+    damage->scroll_top = top;
+    damage->scroll_bot = bot;
+  } else if (damage->scroll_top != top || damage->scroll_bot != bot) {
+    damage->all = true;
+    return;
   }
+  damage->scroll += n;
+  if (abs(damage->scroll) >= bot - top + 1)
+    damage->all = true;
+}
 
-  for (int j = top; j < bot; j++) {
-    for (int k = 0; k < width; k++) {
-      screen->lines[j].cells[k] = screen->lines[j + 1].cells[k];
-    }
+// Rotates rows top..bot up by n (down if n is negative) by moving row
+// pointers, so row top + n becomes row top. A full-screen rotation only moves
+// the ring base. Rows keep their damage; the caller clears and damages the
+// rows it exposes.
+void rotate_lines(Term_Screen *screen, int top, int bot, int n) {
+  int rows = bot - top + 1;
+  if (rows <= 1)
+    return;
+  damage_scroll(screen, top, bot, n);
+  n %= rows;
+  if (n < 0)
+    n += rows;
+  if (n == 0)
+    return;
+  if (top == 0 && rows == screen->line_count) {
+    screen->line_base = (screen->line_base + n) % screen->line_count;
+    return;
   }
+  reverse_lines(screen, top, top + n - 1);
+  reverse_lines(screen, top + n, bot);
+  reverse_lines(screen, top, bot);
+}
+
+void clear_lines(Term_Screen *screen, int top, int bot, int width,
+                 uint16_t attr) {
   Term_Cell blank = {0};
-  blank.attr.bg = screen->cursor.attr.bg;
-  for (int k = 0; k < width; k++) {
-    screen->lines[bot].cells[k] = blank;
+  blank.attr = attr;
+  for (int j = top; j <= bot; j++) {
+    Term_Cell *cells = screen_line(screen, j);
+    // memcpy stores the cell as one word rather than field by field
+    for (int k = 0; k < width; k++)
+      memcpy(&cells[k], &blank, sizeof(blank));
+  }
+  damage_lines(screen, top, bot);
+}
+
+void damage_lines(Term_Screen *screen, int top, int bot) {
+  for (int y = top; y <= bot; y++) {
+    Term_Line *line = screen_row(screen, y);
+    line->damage_x0 = 0;
+    line->damage_x1 = INT_MAX;
+  }
+}
+
+void damage_screen(Term_Screen *screen) { screen->damage.all = true; }
+
+// Returns whether row y needs a redraw, and which columns
+bool row_damage(const Term_Screen *screen, int y, int width, int *x0,
+                int *x1) {
+  const Term_Line *line = screen_row(screen, y);
+  *x0 = screen->damage.all ? 0 : line->damage_x0;
+  *x1 = screen->damage.all ? width - 1 : line->damage_x1;
+  if (*x1 >= width)
+    *x1 = width - 1;
+  return *x0 <= *x1;
+}
+
+void clear_damage(Term_Screen *screen, int height) {
+  for (int i = 0; i < height; i++) {
+    screen->lines[i].damage_x0 = INT_MAX;
+    screen->lines[i].damage_x1 = -1;
   }
+  screen->damage = (Term_Damage){0};
+}
+
+void scroll_screen(Term_Screen *screen, int width, int height) {
+  (void)height;
+  int top = screen->scroll_top;
+  int bot = screen->scroll_bot;
+
+  if (top == 0 && screen->scrollback.capacity > 0)
+    push_scrollback_line(&screen->scrollback, screen_line(screen, top), width);
+
+  rotate_lines(screen, top, bot, 1);
+  clear_lines(screen, bot, bot, width, screen->cursor.bg_attr_id);
   screen->scrolled = true;
 }
 
@@ -185,45 +185,89 @@ void handle_newline(Term_Screen *screen, int width, int height) {
   }
 }
 
-void write_regular_cell(Term_Screen *screen, const char *data, int data_len,
-                        int width, int height, Term_Attr attr) {
-  int cp = utf8_decode(data, data_len);
-  int char_display_width = (cp >= 0 && is_wide_codepoint(cp)) ? 2 : 1;
-
-  if (screen->cursor.x >= width) {
-    handle_newline(screen, width, height);
-    screen->cursor.x = 0;
-  }
+void write_regular_cell(Term_Screen *screen, uint32_t cp, bool wide, int width,
+                        int height, uint16_t attr) {
+  if (screen->cursor.x >= width)
+    autowrap(screen, width, height);
 
   // Wrap if a wide char won't fit, fill the last column with a space
-  if (char_display_width == 2 && screen->cursor.x + 1 >= width) {
-    if (screen->cursor.y < height)
-      memset(&screen->lines[screen->cursor.y].cells[screen->cursor.x], 0,
+  if (wide && screen->cursor.x + 1 >= width) {
+    if (screen->cursor.y < height) {
+      memset(&screen_line(screen, screen->cursor.y)[screen->cursor.x], 0,
              sizeof(Term_Cell));
-    handle_newline(screen, width, height);
-    screen->cursor.x = 0;
+      damage_cells(screen, screen->cursor.y, screen->cursor.x,
+                   screen->cursor.x);
+    }
+    autowrap(screen, width, height);
   }
 
   if (screen->cursor.y < height) {
-    Term_Cell *cell = &screen->lines[screen->cursor.y].cells[screen->cursor.x];
-    if (data_len > 6)
-      data_len = 6;
-    memcpy(cell->data, data, data_len);
-    cell->length = data_len;
-    cell->attr = attr;
-    cell->wide = (char_display_width == 2) ? 1 : 0;
-    cell->wide_cont = 0;
+    Term_Cell *cells = screen_line(screen, screen->cursor.y);
+    cells[screen->cursor.x] =
+        (Term_Cell){.cp = cp, .attr = attr, .flags = wide ? CELL_WIDE : 0};
+    damage_cells(screen, screen->cursor.y, screen->cursor.x,
+                 screen->cursor.x + (wide && screen->cursor.x + 1 < width));
     screen->cursor.x++;
 
-    if (char_display_width == 2 && screen->cursor.x < width) {
-      Term_Cell *cont =
-          &screen->lines[screen->cursor.y].cells[screen->cursor.x];
-      *cont = (Term_Cell){.attr = attr, .wide_cont = 1};
+    if (wide && screen->cursor.x < width) {
+      cells[screen->cursor.x] =
+          (Term_Cell){.attr = attr, .flags = CELL_WIDE_CONT};
       screen->cursor.x++;
     }
   }
 }
 
+// Writes a run of printable ASCII, one narrow cell per byte, filling each line
+// in a single pass and wrapping only at the span boundary
+void write_cell_run(Term_Screen *screen, const char *data, int data_len,
+                    int width, int height, uint16_t attr) {
+  while (data_len > 0) {
+    if (screen->cursor.x >= width)
+      autowrap(screen, width, height);
+    if (screen->cursor.y >= height)
+      return;
+
+    int n = width - screen->cursor.x;
+    if (n > data_len)
+      n = data_len;
+    Term_Cell *cells = &screen_line(screen, screen->cursor.y)[screen->cursor.x];
+    for (int i = 0; i < n; i++)
+      cells[i] = (Term_Cell){.cp = (unsigned char)data[i], .attr = attr};
+    damage_cells(screen, screen->cursor.y, screen->cursor.x,
+                 screen->cursor.x + n - 1);
+    screen->cursor.x += n;
+    data += n;
+    data_len -= n;
+  }
+}
+
+// Flags every attribute and cluster id referenced by the screen, its
+// scrollback and its cursors. Either array may be NULL.
+static void mark_cells(const Term_Cell *cells, int count, uint8_t *attrs,
+                       uint8_t *clusters) {
+  for (int i = 0; i < count; i++) {
+    if (attrs)
+      attrs[cells[i].attr] = 1;
+    if (clusters && (cells[i].flags & CELL_CLUSTER))
+      clusters[cells[i].cp] = 1;
+  }
+}
+
+void mark_screen_refs(Term_Screen *screen, int width, int height,
+                      uint8_t *attrs, uint8_t *clusters) {
+  if (!screen->lines)
+    return;
+  for (int i = 0; i < height; i++)
+    mark_cells(screen->lines[i].cells, width, attrs, clusters);
+  mark_scrollback_refs(&screen->scrollback, attrs, clusters);
+  if (attrs) {
+    attrs[screen->cursor.attr_id] = 1;
+    attrs[screen->cursor.bg_attr_id] = 1;
+    attrs[screen->saved_cursor.attr_id] = 1;
+    attrs[screen->saved_cursor.bg_attr_id] = 1;
+  }
+}
+
 void resize_screen(Term_Screen *screen, int old_width, int old_height,
                    int new_width, int new_height) {
   screen->scroll_offset = 0;
@@ -244,7 +288,7 @@ void resize_screen(Term_Screen *screen, int old_width, int old_height,
 
   for (int i = 0; i < copy_height; i++) {
     for (int j = 0; j < copy_width; j++) {
-      new_lines[i].cells[j] = screen->lines[i].cells[j];
+      new_lines[i].cells[j] = screen_line(screen, i)[j];
     }
   }
 
@@ -254,6 +298,10 @@ void resize_screen(Term_Screen *screen, int old_width, int old_height,
   free(screen->lines);
 
   screen->lines = new_lines;
+  screen->line_base = 0;
+  screen->line_count = new_height;
+  clear_damage(screen, new_height);
+  screen->damage.all = true;
 
   if (screen->cursor.x >= new_width) {
     screen->cursor.x = new_width - 1;
@@ -1,16 +1,51 @@
 #ifndef SCREEN_H
 #define SCREEN_H
 
+#include <limits.h>
+
 #include "terminal.h"
 
+// Visible row y, 0 <= y < height
+static inline Term_Line *screen_row(const Term_Screen *screen, int y) {
+  int i = screen->line_base + y;
+  if (i >= screen->line_count)
+    i -= screen->line_count;
+  return &screen->lines[i];
+}
+
+// Cells of visible row y
+static inline Term_Cell *screen_line(const Term_Screen *screen, int y) {
+  return screen_row(screen, y)->cells;
+}
+
+// Records that columns x0..x1 of visible row y changed
+static inline void damage_cells(Term_Screen *screen, int y, int x0, int x1) {
+  Term_Line *line = screen_row(screen, y);
+  if (x0 < line->damage_x0)
+    line->damage_x0 = x0;
+  if (x1 > line->damage_x1)
+    line->damage_x1 = x1;
+}
+
 void init_screen(Term_Screen *screen, int width, int height,
                  int scrollback_lines);
 void free_screen(Term_Screen *screen, int height);
 void reset_screen(Term_Screen *screen, int width, int height);
 void scroll_screen(Term_Screen *screen, int width, int height);
+void rotate_lines(Term_Screen *screen, int top, int bot, int n);
+void clear_lines(Term_Screen *screen, int top, int bot, int width,
+                 uint16_t attr);
 void handle_newline(Term_Screen *screen, int width, int height);
-void write_regular_cell(Term_Screen *screen, const char *data, int data_len,
-                        int width, int height, Term_Attr attr);
+void write_regular_cell(Term_Screen *screen, uint32_t cp, bool wide, int width,
+                        int height, uint16_t attr);
+void write_cell_run(Term_Screen *screen, const char *data, int data_len,
+                    int width, int height, uint16_t attr);
+void mark_screen_refs(Term_Screen *screen, int width, int height,
+                      uint8_t *attrs, uint8_t *clusters);
+void damage_lines(Term_Screen *screen, int top, int bot);
+void damage_screen(Term_Screen *screen);
+bool row_damage(const Term_Screen *screen, int y, int width, int *x0, int *x1);
+void clear_damage(Term_Screen *screen, int height);
 void resize_screen(Term_Screen *screen, int old_width, int old_height,
                    int new_width, int new_height);
 
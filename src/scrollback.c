@@ -0,0 +1,654 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "lz.h"
+#include "scrollback.h"
+
+// Log the memory saved by compression every this many blocks
+#define COMPRESS_LOG_INTERVAL 256
+
+static void add_bytes(Term_Scrollback *sb, ptrdiff_t delta) {
+  sb->bytes += delta;
+  if (sb->bytes > sb->peak_bytes)
+    sb->peak_bytes = sb->bytes;
+}
+
+// Hands a block's buffer back, keeping one full-size buffer for reuse
+static void release_data(Term_Scrollback *sb, uint8_t *data, int size) {
+  if (!sb->spare && size == SCROLLBACK_BLOCK_SIZE)
+    sb->spare = data;
+  else
+    free(data);
+}
+
+// Drops the cached copy of a compressed block
+static void uncache_block(Term_Scrollback *sb, const Term_ScrollBlock *block) {
+  for (int i = 0; i < SCROLLBACK_CACHE_BLOCKS; i++)
+    if (sb->cache[i].block == block)
+      sb->cache[i] = (Term_ScrollCache){NULL, sb->cache[i].data,
+                                        sb->cache[i].size, 0};
+}
+
+static void free_block(Term_Scrollback *sb, Term_ScrollBlock *block) {
+  if (block->data) {
+    add_bytes(sb, -block->size);
+    release_data(sb, block->data, block->size);
+  } else {
+    add_bytes(sb, -block->lz_size);
+    uncache_block(sb, block);
+    free(block->lz);
+    sb->raw_bytes -= block->used;
+    sb->lz_bytes -= block->lz_size;
+  }
+  free(block);
+}
+
+// Replaces a closed block's data with its compressed form, unless that
+// saves less than an eighth
+static void compress_block(Term_Scrollback *sb, Term_ScrollBlock *block) {
+  int cap = block->used - block->used / 8;
+  uint8_t *lz = malloc(cap);
+  int size = lz ? lz_compress(block->data, block->used, lz, cap) : 0;
+  if (size == 0) {
+    free(lz);
+    return;
+  }
+  uint8_t *shrunk = realloc(lz, size);
+  block->lz = shrunk ? shrunk : lz;
+  block->lz_size = size;
+  add_bytes(sb, size - block->size);
+  release_data(sb, block->data, block->size);
+  block->data = NULL;
+
+  sb->raw_bytes += block->used;
+  sb->lz_bytes += size;
+  if (++sb->compressed_blocks % COMPRESS_LOG_INTERVAL == 0)
+    LOG_INFO_MSG("Scrollback compression: %zu KB packed in %zu KB, %zu KB "
+                 "saved",
+                 sb->raw_bytes / 1024, sb->lz_bytes / 1024,
+                 (sb->raw_bytes - sb->lz_bytes) / 1024);
+}
+
+// Compresses the blocks that have fallen compress_after lines behind
+static void compress_cold_blocks(Term_Scrollback *sb) {
+  if (sb->compress_after <= 0)
+    return;
+  while (sb->hot && sb->hot != sb->newest &&
+         sb->hot_lines - sb->hot->lines >= sb->compress_after) {
+    compress_block(sb, sb->hot);
+    sb->hot_lines -= sb->hot->lines;
+    sb->hot = sb->hot->next;
+  }
+}
+
+// Returns the packed lines of a block, expanding a compressed block into the
+// least recently used cache slot. Returns NULL if the block can't be
+// expanded; its lines then read as blank.
+static const uint8_t *block_data(Term_Scrollback *sb,
+                                 const Term_ScrollBlock *block) {
+  if (block->data)
+    return block->data;
+  Term_ScrollCache *slot = &sb->cache[0];
+  for (int i = 0; i < SCROLLBACK_CACHE_BLOCKS; i++) {
+    Term_ScrollCache *c = &sb->cache[i];
+    if (c->block == block) {
+      c->used = ++sb->cache_clock;
+      return c->data;
+    }
+    if (c->used < slot->used)
+      slot = c;
+  }
+  slot->block = NULL;
+  if (slot->size < block->used) {
+    int size = block->used > SCROLLBACK_BLOCK_SIZE ? block->used
+                                                   : SCROLLBACK_BLOCK_SIZE;
+    free(slot->data);
+    slot->data = malloc(size);
+    slot->size = slot->data ? size : 0;
+    if (!slot->data) {
+      LOG_ERROR_MSG("Cannot allocate scrollback cache block");
+      return NULL;
+    }
+  }
+  if (lz_decompress(block->lz, block->lz_size, slot->data, block->used) !=
+      block->used) {
+    LOG_ERROR_MSG("Corrupt compressed scrollback block");
+    return NULL;
+  }
+  slot->block = block;
+  slot->used = ++sb->cache_clock;
+  return slot->data;
+}
+
+// Returns bytes of room at the end of the newest block, starting a new block
+// when it is full
+static void *alloc_scrollback_line(Term_Scrollback *sb, int bytes) {
+  Term_ScrollBlock *block = sb->newest;
+  int max_lines = sb->compress_after > 0 ? SCROLLBACK_BLOCK_LINES : INT32_MAX;
+  if (!block || block->used + bytes > block->size ||
+      block->count >= max_lines) {
+    // A block bound for compression gives back its unused tail
+    if (block && sb->compress_after > 0 && block->used < block->size) {
+      uint8_t *shrunk = realloc(block->data, block->used);
+      if (shrunk) {
+        add_bytes(sb, block->used - block->size);
+        block->data = shrunk;
+        block->size = block->used;
+      }
+    }
+    int size = bytes > SCROLLBACK_BLOCK_SIZE ? bytes : SCROLLBACK_BLOCK_SIZE;
+    block = calloc(1, sizeof(Term_ScrollBlock));
+    if (size == SCROLLBACK_BLOCK_SIZE && sb->spare) {
+      block->data = sb->spare;
+      sb->spare = NULL;
+    } else {
+      block->data = malloc(size);
+    }
+    block->size = size;
+    add_bytes(sb, size);
+    if (sb->newest)
+      sb->newest->next = block;
+    else
+      sb->oldest = block;
+    sb->newest = block;
+    if (!sb->hot)
+      sb->hot = block;
+  }
+  void *line = block->data + block->used;
+  block->used += bytes;
+  block->count++;
+  block->lines++;
+  sb->hot_lines++;
+  return line;
+}
+
+static inline int cp_size(uint8_t format) {
+  return (format & SCROLL_LINE_BYTE_CPS) ? 1 : 4;
+}
+
+static inline void *line_cps(const Term_ScrollLine *line) {
+  return (void *)(line + 1);
+}
+
+static inline uint8_t *line_flags(const Term_ScrollLine *line) {
+  return (uint8_t *)line_cps(line) + line->length * cp_size(line->format);
+}
+
+static inline Term_AttrRun *line_runs(const Term_ScrollLine *line) {
+  int flags = (line->format & SCROLL_LINE_FLAGS) ? line->length : 0;
+  uintptr_t end = (uintptr_t)(line_flags(line) + flags);
+  return (Term_AttrRun *)((end + 1) & ~(uintptr_t)1);
+}
+
+static inline uint32_t line_cp(const Term_ScrollLine *line, int x) {
+  if (line->format & SCROLL_LINE_BYTE_CPS)
+    return ((const uint8_t *)line_cps(line))[x];
+  return ((const uint32_t *)line_cps(line))[x];
+}
+
+// Bytes from the header to the end of the runs
+static inline int line_size(const Term_ScrollLine *line) {
+  return (const uint8_t *)(line_runs(line) + line->run_count) -
+         (const uint8_t *)line;
+}
+
+_Static_assert(sizeof(Term_Cell) == 8, "cell_bits() reads a cell as a word");
+
+// A cell as a word. Padding can only make two equal cells compare unequal.
+static inline uint64_t cell_bits(Term_Cell cell) {
+  uint64_t bits;
+  memcpy(&bits, &cell, sizeof(bits));
+  return bits;
+}
+
+// Packs a row into the scrollback: trailing blanks are dropped, attributes
+// become runs, and code points and flags shrink to bytes when they can
+static Term_ScrollLine *pack_scrollback_line(Term_Scrollback *sb,
+                                             const Term_Cell *cells,
+                                             int width) {
+  uint16_t fill = 0;
+  if (width > 0 && cells[width - 1].cp == 0 && cells[width - 1].flags == 0)
+    fill = cells[width - 1].attr;
+  uint64_t mask = cell_bits((Term_Cell){UINT32_MAX, UINT16_MAX, UINT8_MAX});
+  uint64_t blank = cell_bits((Term_Cell){.attr = fill});
+  int length = width;
+  while (length > 0 && (cell_bits(cells[length - 1]) & mask) == blank)
+    length--;
+
+  // Room for the widest layout; the unused tail is handed back below
+  int max_bytes = sizeof(Term_ScrollLine) + length * (4 + 1) + 1 +
+                  length * sizeof(Term_AttrRun);
+  max_bytes = (max_bytes + 7) & ~7;
+  Term_ScrollLine *line = alloc_scrollback_line(sb, max_bytes);
+  line->length = length;
+  line->fill_attr = fill;
+
+  // One pass assuming the common case, byte code points and no flags, that
+  // also ORs every cell together to check the assumption
+  line->format = SCROLL_LINE_BYTE_CPS;
+  uint8_t *narrow = line_cps(line);
+  Term_AttrRun *runs = line_runs(line);
+  int run_count = 0;
+  int start = 0;
+  uint16_t attr = length > 0 ? cells[0].attr : 0;
+  uint64_t any = 0;
+  for (int i = 0; i < length; i++) {
+    any |= cell_bits(cells[i]);
+    narrow[i] = cells[i].cp;
+    if (cells[i].attr != attr) {
+      runs[run_count++] = (Term_AttrRun){attr, i - start};
+      attr = cells[i].attr;
+      start = i;
+    }
+  }
+  if (length > 0)
+    runs[run_count++] = (Term_AttrRun){attr, length - start};
+  line->run_count = run_count;
+
+  Term_Cell all;
+  memcpy(&all, &any, sizeof(all));
+  if (all.cp >= 0x100 || all.flags) {
+    line->format = (all.cp < 0x100 ? SCROLL_LINE_BYTE_CPS : 0) |
+                   (all.flags ? SCROLL_LINE_FLAGS : 0);
+    Term_AttrRun *moved = line_runs(line);
+    memmove(moved, runs, run_count * sizeof(Term_AttrRun));
+    runs = moved;
+    if (!(line->format & SCROLL_LINE_BYTE_CPS)) {
+      uint32_t *cps = line_cps(line);
+      for (int i = 0; i < length; i++)
+        cps[i] = cells[i].cp;
+    }
+    if (line->format & SCROLL_LINE_FLAGS) {
+      uint8_t *flags = line_flags(line);
+      for (int i = 0; i < length; i++)
+        flags[i] = cells[i].flags;
+    }
+  }
+
+  int bytes = (char *)(runs + run_count) - (char *)line;
+  sb->newest->used -= max_bytes - ((bytes + 7) & ~7);
+  return line;
+}
+
+static void close_spill_segment(Term_SpillSegment *seg, size_t size) {
+  munmap(seg->map, size);
+  close(seg->fd);
+  free(seg->index);
+  memset(seg, 0, sizeof(*seg));
+}
+
+// Stops spilling for good, keeping the lines already spilled readable
+static void disable_spill(Term_Spill *spill, const char *why) {
+  LOG_WARNING_MSG("Scrollback spill file disabled: %s", why);
+  spill->failed = true;
+}
+
+// Opens an empty segment: an unlinked file under $XDG_RUNTIME_DIR (or /tmp)
+// mapped at its full size. File space is only allocated as lines arrive.
+static bool open_spill_segment(Term_Spill *spill, Term_SpillSegment *seg) {
+  const char *dir = getenv("XDG_RUNTIME_DIR");
+  if (!dir || !*dir)
+    dir = "/tmp";
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/terminal-scrollback-XXXXXX", dir);
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    disable_spill(spill, "cannot create a file in $XDG_RUNTIME_DIR");
+    return false;
+  }
+  unlink(path);
+  void *map = mmap(NULL, spill->segment_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    close(fd);
+    disable_spill(spill, "mmap failed");
+    return false;
+  }
+  memset(seg, 0, sizeof(*seg));
+  seg->fd = fd;
+  seg->map = map;
+  LOG_INFO_MSG("Scrollback spill segment of %zu MB opened in %s",
+               spill->segment_size / (1024 * 1024), dir);
+  return true;
+}
+
+// Returns a segment with room for bytes more, emptying the oldest segment and
+// moving it to the end when all of them are full
+static Term_SpillSegment *spill_segment(Term_Scrollback *sb, size_t bytes) {
+  Term_Spill *spill = &sb->spill;
+  if (spill->segment_count > 0) {
+    Term_SpillSegment *seg = &spill->segments[spill->segment_count - 1];
+    if (seg->used + bytes <= spill->segment_size)
+      return seg;
+  }
+  if (spill->segment_count < SPILL_SEGMENTS) {
+    Term_SpillSegment *seg = &spill->segments[spill->segment_count];
+    if (!open_spill_segment(spill, seg))
+      return NULL;
+    spill->segment_count++;
+    return seg;
+  }
+
+  Term_SpillSegment oldest = spill->segments[0];
+  memmove(&spill->segments[0], &spill->segments[1],
+          (SPILL_SEGMENTS - 1) * sizeof(Term_SpillSegment));
+  spill->count -= oldest.lines;
+  sb->count -= oldest.lines;
+  // Truncating hands the file's pages back
+  if (ftruncate(oldest.fd, 0) < 0)
+    LOG_WARNING_MSG("Cannot truncate scrollback spill segment");
+  oldest.used = 0;
+  oldest.reserved = 0;
+  oldest.lines = 0;
+  spill->segments[SPILL_SEGMENTS - 1] = oldest;
+  return &spill->segments[SPILL_SEGMENTS - 1];
+}
+
+// Appends the ring's oldest line to the spill file. Returns false if it was
+// not spilled and is about to be lost.
+static bool spill_oldest_line(Term_Scrollback *sb) {
+  Term_Spill *spill = &sb->spill;
+  if (spill->segment_size == 0 || spill->failed)
+    return false;
+  const Term_ScrollEntry *e = &sb->lines[sb->head];
+  const uint8_t *data = block_data(sb, e->block);
+  if (!data)
+    return false;
+  const Term_ScrollLine *line = (const Term_ScrollLine *)(data + e->offset);
+  int size = line_size(line);
+  size_t bytes = (sizeof(Term_SpillRecord) + size + 7) & ~(size_t)7;
+  if (bytes > spill->segment_size)
+    return false;
+  Term_SpillSegment *seg = spill_segment(sb, bytes);
+  if (!seg)
+    return false;
+
+  // Reserve file space ahead of writes so a full filesystem is an error
+  // here rather than SIGBUS on the mapping
+  if (seg->used + bytes > seg->reserved) {
+    size_t reserve = SPILL_RESERVE;
+    if (seg->reserved + reserve > spill->segment_size)
+      reserve = spill->segment_size - seg->reserved;
+    if (posix_fallocate(seg->fd, seg->reserved, reserve) != 0) {
+      disable_spill(spill, "file system full");
+      return false;
+    }
+    seg->reserved += reserve;
+  }
+  if (seg->lines % SPILL_INDEX_STRIDE == 0) {
+    int n = seg->lines / SPILL_INDEX_STRIDE;
+    if (n >= seg->index_capacity) {
+      int capacity = seg->index_capacity ? seg->index_capacity * 2 : 1024;
+      size_t *index = realloc(seg->index, capacity * sizeof(size_t));
+      if (!index)
+        return false;
+      seg->index = index;
+      seg->index_capacity = capacity;
+    }
+    seg->index[n] = seg->used;
+  }
+
+  Term_SpillRecord *record = (Term_SpillRecord *)(seg->map + seg->used);
+  *record = (Term_SpillRecord){bytes, e->width, 0};
+  memcpy(record + 1, line, size);
+  seg->used += bytes;
+  seg->lines++;
+  spill->count++;
+  return true;
+}
+
+static void clear_spill(Term_Spill *spill) {
+  for (int i = 0; i < spill->segment_count; i++)
+    close_spill_segment(&spill->segments[i], spill->segment_size);
+  spill->segment_count = 0;
+  spill->count = 0;
+}
+
+// Finds spilled line row through the segment index, stepping over at most
+// SPILL_INDEX_STRIDE - 1 records
+static const Term_SpillRecord *spill_record(const Term_Spill *spill,
+                                            int row) {
+  const Term_SpillSegment *seg = spill->segments;
+  while (row >= seg->lines)
+    row -= seg++->lines;
+  size_t offset = seg->index[row / SPILL_INDEX_STRIDE];
+  for (int i = 0; i < row % SPILL_INDEX_STRIDE; i++)
+    offset += ((const Term_SpillRecord *)(seg->map + offset))->size;
+  return (const Term_SpillRecord *)(seg->map + offset);
+}
+
+static inline const Term_ScrollEntry *entry(const Term_Scrollback *sb,
+                                            int row) {
+  return &sb->lines[(sb->head + row) % sb->ring_size];
+}
+
+// Returns scrollback row, counting spilled lines first, and its width. The
+// row is NULL if its block can't be read.
+static const Term_ScrollLine *find_line(Term_Scrollback *sb, int row,
+                                        int *width) {
+  if (row < sb->spill.count) {
+    const Term_SpillRecord *record = spill_record(&sb->spill, row);
+    *width = record->width;
+    return (const Term_ScrollLine *)(record + 1);
+  }
+  const Term_ScrollEntry *e = entry(sb, row - sb->spill.count);
+  *width = e->width;
+  const uint8_t *data = block_data(sb, e->block);
+  return data ? (const Term_ScrollLine *)(data + e->offset) : NULL;
+}
+
+int scrollback_width(const Term_Scrollback *sb, int row) {
+  if (row < sb->spill.count)
+    return spill_record(&sb->spill, row)->width;
+  return entry(sb, row - sb->spill.count)->width;
+}
+
+int scrollback_line(Term_Scrollback *sb, int row, Term_Cell *out, int max) {
+  int width;
+  const Term_ScrollLine *line = find_line(sb, row, &width);
+  if (width > max)
+    width = max;
+  if (!line) {
+    memset(out, 0, width * sizeof(Term_Cell));
+    return width;
+  }
+  int length = line->length < width ? line->length : width;
+
+  const Term_AttrRun *runs = line_runs(line);
+  int x = 0;
+  for (int r = 0; r < line->run_count && x < length; r++)
+    for (int k = 0; k < runs[r].length && x < length; k++)
+      out[x++] = (Term_Cell){.attr = runs[r].attr};
+  if (line->format & SCROLL_LINE_BYTE_CPS) {
+    const uint8_t *cps = line_cps(line);
+    for (int i = 0; i < length; i++)
+      out[i].cp = cps[i];
+  } else {
+    const uint32_t *cps = line_cps(line);
+    for (int i = 0; i < length; i++)
+      out[i].cp = cps[i];
+  }
+  if (line->format & SCROLL_LINE_FLAGS) {
+    const uint8_t *flags = line_flags(line);
+    for (int i = 0; i < length; i++)
+      out[i].flags = flags[i];
+  }
+  for (int i = length; i < width; i++)
+    out[i] = (Term_Cell){.attr = line->fill_attr};
+  return width;
+}
+
+Term_Cell scrollback_cell(Term_Scrollback *sb, int row, int x) {
+  int width;
+  const Term_ScrollLine *line = find_line(sb, row, &width);
+  if (!line || x >= width)
+    return (Term_Cell){0};
+  if (x >= line->length)
+    return (Term_Cell){.attr = line->fill_attr};
+
+  Term_Cell cell = {0};
+  const Term_AttrRun *runs = line_runs(line);
+  for (int r = 0, start = 0; r < line->run_count; start += runs[r++].length)
+    if (x < start + runs[r].length) {
+      cell.attr = runs[r].attr;
+      break;
+    }
+  cell.cp = line_cp(line, x);
+  if (line->format & SCROLL_LINE_FLAGS)
+    cell.flags = line_flags(line)[x];
+  return cell;
+}
+
+// Drops the oldest line's hold on its block, releasing the block once it is
+// drained
+static void release_scrollback_line(Term_Scrollback *sb) {
+  Term_ScrollBlock *block = sb->oldest;
+  block->lines--;
+  if (block == sb->hot)
+    sb->hot_lines--;
+  if (block->lines > 0)
+    return;
+  sb->oldest = block->next;
+  if (!sb->oldest)
+    sb->newest = NULL;
+  if (sb->hot == block)
+    sb->hot = block->next;
+  free_block(sb, block);
+}
+
+// Moves the ring's oldest line to the spill file, or drops it
+static void evict_oldest_line(Term_Scrollback *sb) {
+  // A spilled line stays readable, so only a dropped one leaves the count
+  if (!spill_oldest_line(sb))
+    sb->count--;
+  release_scrollback_line(sb);
+  sb->head = (sb->head + 1) % sb->ring_size;
+}
+
+// Doubles the ring, up to capacity, unrolling it to start at index 0
+static bool grow_ring(Term_Scrollback *sb, int ring) {
+  int size = sb->ring_size ? sb->ring_size * 2 : 1024;
+  if (size > sb->capacity)
+    size = sb->capacity;
+  Term_ScrollEntry *lines = malloc(size * sizeof(Term_ScrollEntry));
+  if (!lines)
+    return false;
+  for (int i = 0; i < ring; i++)
+    lines[i] = sb->lines[(sb->head + i) % sb->ring_size];
+  free(sb->lines);
+  sb->lines = lines;
+  sb->ring_size = size;
+  sb->head = 0;
+  return true;
+}
+
+void push_scrollback_line(Term_Scrollback *sb, const Term_Cell *cells,
+                          int width) {
+  int ring = sb->count - sb->spill.count;
+  if (ring == sb->ring_size &&
+      (ring == sb->capacity || !grow_ring(sb, ring))) {
+    evict_oldest_line(sb);
+    ring--;
+  }
+  int idx = (sb->head + ring) % sb->ring_size;
+  sb->count++;
+  Term_ScrollLine *line = pack_scrollback_line(sb, cells, width);
+  sb->lines[idx] = (Term_ScrollEntry){
+      sb->newest, (int)((uint8_t *)line - sb->newest->data), width};
+  compress_cold_blocks(sb);
+
+  // Storage only shrinks when a block drains, so an overdrawn budget
+  // evicts up to a block's worth of lines
+  while (sb->max_bytes && sb->bytes > sb->max_bytes &&
+         sb->count - sb->spill.count > 1)
+    evict_oldest_line(sb);
+}
+
+void clear_scrollback(Term_Scrollback *sb) {
+  while (sb->oldest) {
+    Term_ScrollBlock *next = sb->oldest->next;
+    free_block(sb, sb->oldest);
+    sb->oldest = next;
+  }
+  free(sb->spare);
+  clear_spill(&sb->spill);
+  sb->newest = NULL;
+  sb->hot = NULL;
+  sb->hot_lines = 0;
+  sb->spare = NULL;
+  free(sb->lines);
+  sb->lines = NULL;
+  sb->ring_size = 0;
+  sb->count = 0;
+  sb->head = 0;
+}
+
+void init_scrollback(Term_Scrollback *sb, int capacity) {
+  memset(sb, 0, sizeof(*sb));
+  sb->capacity = capacity;
+}
+
+void free_scrollback(Term_Scrollback *sb) {
+  clear_scrollback(sb);
+  for (int i = 0; i < SCROLLBACK_CACHE_BLOCKS; i++)
+    free(sb->cache[i].data);
+}
+
+void log_scrollback_stats(const Term_Scrollback *sb, const char *name) {
+  int lines = sb->count - sb->spill.count;
+  size_t spilled = 0;
+  for (int i = 0; i < sb->spill.segment_count; i++)
+    spilled += sb->spill.segments[i].used;
+  size_t cached = sb->spare ? SCROLLBACK_BLOCK_SIZE : 0;
+  for (int i = 0; i < SCROLLBACK_CACHE_BLOCKS; i++)
+    cached += sb->cache[i].size;
+  LOG_INFO_MSG("%s scrollback: %d lines, %zu KB held, %zu bytes/line, peak "
+               "%zu KB, limit %zu KB; outside the limit: index %zu KB, "
+               "cache and spare %zu KB; %d lines (%zu KB) spilled",
+               name, lines, sb->bytes / 1024,
+               lines ? sb->bytes / lines : 0, sb->peak_bytes / 1024,
+               sb->max_bytes / 1024,
+               sb->ring_size * sizeof(Term_ScrollEntry) / 1024,
+               cached / 1024, sb->spill.count, spilled / 1024);
+}
+
+static void mark_line(const Term_ScrollLine *line, uint8_t *attrs,
+                      uint8_t *clusters) {
+  if (!line)
+    return;
+  if (attrs) {
+    attrs[line->fill_attr] = 1;
+    for (int r = 0; r < line->run_count; r++)
+      attrs[line_runs(line)[r].attr] = 1;
+  }
+  if (clusters && (line->format & SCROLL_LINE_FLAGS)) {
+    const uint8_t *flags = line_flags(line);
+    for (int x = 0; x < line->length; x++)
+      if (flags[x] & CELL_CLUSTER)
+        clusters[line_cp(line, x)] = 1;
+  }
+}
+
+void mark_scrollback_refs(Term_Scrollback *sb, uint8_t *attrs,
+                          uint8_t *clusters) {
+  const Term_Spill *spill = &sb->spill;
+  for (int i = 0; i < spill->segment_count; i++) {
+    const Term_SpillSegment *seg = &spill->segments[i];
+    for (size_t offset = 0; offset < seg->used;) {
+      const Term_SpillRecord *record =
+          (const Term_SpillRecord *)(seg->map + offset);
+      mark_line((const Term_ScrollLine *)(record + 1), attrs, clusters);
+      offset += record->size;
+    }
+  }
+  for (int i = sb->spill.count; i < sb->count; i++) {
+    int width;
+    mark_line(find_line(sb, i, &width), attrs, clusters);
+  }
+}
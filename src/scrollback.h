@@ -0,0 +1,18 @@
+#ifndef SCROLLBACK_H
+#define SCROLLBACK_H
+
+#include "terminal.h"
+
+void init_scrollback(Term_Scrollback *sb, int capacity);
+void free_scrollback(Term_Scrollback *sb);
+void clear_scrollback(Term_Scrollback *sb);
+void push_scrollback_line(Term_Scrollback *sb, const Term_Cell *cells,
+                          int width);
+int scrollback_width(const Term_Scrollback *sb, int row);
+int scrollback_line(Term_Scrollback *sb, int row, Term_Cell *out, int max);
+Term_Cell scrollback_cell(Term_Scrollback *sb, int row, int x);
+void log_scrollback_stats(const Term_Scrollback *sb, const char *name);
+void mark_scrollback_refs(Term_Scrollback *sb, uint8_t *attrs,
+                          uint8_t *clusters);
+
+#endif
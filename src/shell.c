@@ -1,8 +1,10 @@
 #include <fcntl.h>
 #include <pty.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/ioctl.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "log.h"
@@ -39,6 +41,12 @@ void init_shell(GuiContext *gui, int cols, int rows) {
   if (pid == 0) {
     close(master);
 
+    // SIGCHLD is blocked in the GUI to be read from a signalfd; the shell
+    // shouldn't inherit that
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+
     setsid();
     ioctl(slave, TIOCSCTTY, 0);
 
@@ -66,11 +74,52 @@ void init_shell(GuiContext *gui, int cols, int rows) {
   }
 }
 
+// Reads and parses shell output until it runs dry or the read slice is used
+// up, so that a flood of output can't hold off key presses, resizes and
+// redraws. What is left is read on the next pass of the event loop.
 void read_shell_output(GuiContext *gui, Terminal *terminal) {
-  char buffer[4096];
+  GuiProcess *process = &gui->process;
+  if (!process->read_buffer) {
+    process->read_size = READ_BUFFER_MIN;
+    process->read_buffer = malloc(process->read_size);
+    if (!process->read_buffer)
+      return;
+  }
+
+  struct timespec start, before, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  before = start;
+  size_t total = 0;
   ssize_t bytes_read;
+  while ((bytes_read = read(process->pipe_fd, process->read_buffer, process->read_size)) > 0) {
+    write_terminal(terminal, process->read_buffer, bytes_read);
+    total += bytes_read;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long chunk_ns = (now.tv_sec - before.tv_sec) * 1000000000L + (now.tv_nsec - before.tv_nsec);
+    before = now;
+
+    // A full read means more is waiting: read more at a time, as long as a
+    // buffer still parses well within the slice. A read that used a small
+    // part of the buffer means the output has slowed down.
+    size_t size = process->read_size;
+    if ((size_t)bytes_read == size && chunk_ns < process->read_slice_ns / 4 &&
+        size < READ_BUFFER_MAX)
+      size *= 2;
+    else if (((size_t)bytes_read < size / 8 || chunk_ns > process->read_slice_ns) &&
+             size > READ_BUFFER_MIN)
+      size /= 2;
+    if (size != process->read_size) {
+      char *buffer = realloc(process->read_buffer, size);
+      if (buffer) {
+        process->read_buffer = buffer;
+        process->read_size = size;
+      }
+    }
 
-  while ((bytes_read = read(gui->process.pipe_fd, buffer, sizeof(buffer))) > 0) {
-    write_terminal(terminal, buffer, bytes_read);
+    if (total >= process->read_slice_bytes)
+      break;
+    if ((now.tv_sec - start.tv_sec) * 1000000000L + (now.tv_nsec - start.tv_nsec) >=
+        process->read_slice_ns)
+      break;
   }
 }
@@ -2,12 +2,27 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "attr.h"
+#include "cluster.h"
 #include "log.h"
 #include "screen.h"
+#include "scrollback.h"
 #include "terminal.h"
 #include "tokenize.h"
+#include "width_table.h"
 
-static void handle_erase(Term_Screen *screen, Term_TokenType type, int width,
+// What an ED or EL sequence erases
+typedef enum {
+  ERASE_EOL,        // EL 0
+  ERASE_SOL,        // EL 1
+  ERASE_LINE,       // EL 2
+  ERASE_DOWN,       // ED 0
+  ERASE_UP,         // ED 1
+  ERASE_ALL,        // ED 2
+  ERASE_SCROLLBACK, // ED 3
+} Term_EraseMode;
+
+static void handle_erase(Term_Screen *screen, Term_EraseMode mode, int width,
                          int height);
 
 static void terminal_respond(Terminal *t, const char *data, int len) {
@@ -18,6 +33,13 @@ static void terminal_respond(Terminal *t, const char *data, int len) {
   t->response.response_len += len;
 }
 
+// Interns the cursor's attributes, once per change rather than once per cell
+static void update_cursor_attr(Terminal *terminal, Term_Cursor *cursor) {
+  cursor->attr_id = intern_attr(terminal, &cursor->attr);
+  Term_Attr bg = {.bg = cursor->attr.bg};
+  cursor->bg_attr_id = intern_attr(terminal, &bg);
+}
+
 static void handle_field(Term_Cursor **cursor, int value) {
   if (value == 0) {
     (*cursor)->attr.fg.color = 0;
@@ -79,386 +101,563 @@ static void handle_field(Term_Cursor **cursor, int value) {
   }
 }
 
-static void modify_cursor(Term_Cursor **cursor, Term_Token token) {
-  if (ends_with(token.value, token.length, 'm')) {
-    if (token.length < 3)
-      return;
-    if (token.length == 3) {
-      handle_field(cursor, 0);
-      return;
-    }
+// Parameter i of a CSI sequence, or default_val when it is omitted or 0
+static int csi_arg(const Term_Csi *csi, int i, int default_val) {
+  if (i >= csi->param_count || csi->params[i] == 0)
+    return default_val;
+  return csi->params[i];
+}
 
-    int fields[64];
-    int nf = 0;
-    for (int i = 2; i < token.length - 1 && nf < 64;) {
-      int j = i;
-      while (j < token.length - 1 && token.value[j] != ';')
-        j++;
-      int len = j - i;
-      char buf[16];
-      if (len > 0 && len < (int)sizeof(buf)) {
-        memcpy(buf, token.value + i, len);
-        buf[len] = '\0';
-        fields[nf++] = atoi(buf);
-      } else {
-        fields[nf++] = 0;
-      }
-      i = j + 1;
+// Number of ':' sub-parameters following parameter i
+static int csi_subparam_count(const Term_Csi *csi, int i) {
+  int n = 0;
+  while (i + n + 1 < csi->param_count && (csi->subparams >> (i + n + 1)) & 1)
+    n++;
+  return n;
+}
+
+static void set_extended_color(Term_Color *color, int type, const int *args,
+                               int nargs) {
+  if (type == 5 && nargs >= 1) {
+    if (args[0] >= 0 && args[0] <= 255) {
+      color->type = COLOR_256;
+      color->color = args[0];
     }
+  } else if (type == 2 && nargs >= 3) {
+    int r = args[0] > 255 ? 255 : args[0];
+    int g = args[1] > 255 ? 255 : args[1];
+    int b = args[2] > 255 ? 255 : args[2];
+    color->type = COLOR_RGB;
+    color->rgb = (Term_RGB){r, g, b};
+  }
+}
 
-    for (int i = 0; i < nf;) {
-      if ((fields[i] == 38 || fields[i] == 48) && i + 2 < nf &&
-          fields[i + 1] == 5) {
-        int idx = fields[i + 2];
-        if (idx >= 0 && idx <= 255) {
-          if (fields[i] == 38) {
-            (*cursor)->attr.fg.type = COLOR_256;
-            (*cursor)->attr.fg.color = idx;
-          } else {
-            (*cursor)->attr.bg.type = COLOR_256;
-            (*cursor)->attr.bg.color = idx;
-          }
-        }
+typedef void (*Term_CsiHandler)(Terminal *terminal, Term_Screen *screen,
+                                const Term_Csi *csi);
+
+static void csi_sgr(Terminal *terminal, Term_Screen *screen,
+                    const Term_Csi *csi) {
+  Term_Cursor *cursor = &screen->cursor;
+  if (csi->param_count == 0)
+    handle_field(&cursor, 0);
+
+  for (int i = 0; i < csi->param_count;) {
+    int field = csi->params[i];
+    int subs = csi_subparam_count(csi, i);
+    if ((field == 38 || field == 48) && subs > 0) {
+      // 38:5:n, 38:2:r:g:b or 38:2:colorspace:r:g:b
+      Term_Color *color = field == 38 ? &cursor->attr.fg : &cursor->attr.bg;
+      int type = csi->params[i + 1];
+      const int *args = &csi->params[i + 2];
+      int nargs = subs - 1;
+      if (type == 2 && nargs >= 4) {
+        args++;
+        nargs--;
+      }
+      set_extended_color(color, type, args, nargs);
+      i += 1 + subs;
+    } else if (field == 38 || field == 48) {
+      // 38;5;n or 38;2;r;g;b
+      Term_Color *color = field == 38 ? &cursor->attr.fg : &cursor->attr.bg;
+      int type = i + 1 < csi->param_count ? csi->params[i + 1] : 0;
+      int nargs = csi->param_count - i - 2;
+      if (type == 5 && nargs >= 1) {
+        set_extended_color(color, type, &csi->params[i + 2], nargs);
         i += 3;
-      } else if ((fields[i] == 38 || fields[i] == 48) && i + 4 < nf &&
-                 fields[i + 1] == 2) {
-        int r = fields[i + 2], g = fields[i + 3], b = fields[i + 4];
-        r = r < 0 ? 0 : (r > 255 ? 255 : r);
-        g = g < 0 ? 0 : (g > 255 ? 255 : g);
-        b = b < 0 ? 0 : (b > 255 ? 255 : b);
-        if (fields[i] == 38) {
-          (*cursor)->attr.fg.type = COLOR_RGB;
-          (*cursor)->attr.fg.rgb = (Term_RGB){r, g, b};
-        } else {
-          (*cursor)->attr.bg.type = COLOR_RGB;
-          (*cursor)->attr.bg.rgb = (Term_RGB){r, g, b};
-        }
+      } else if (type == 2 && nargs >= 3) {
+        set_extended_color(color, type, &csi->params[i + 2], nargs);
         i += 5;
       } else {
-        handle_field(cursor, fields[i]);
         i++;
       }
+    } else if (field == 4 && subs > 0) {
+      cursor->attr.underline = csi->params[i + 1] != 0; // 4:0 is no underline
+      i += 1 + subs;
+    } else {
+      handle_field(&cursor, field);
+      i += 1 + subs;
     }
-  } else if (ends_with(token.value, token.length, 'H') ||
-             ends_with(token.value, token.length, 'f')) {
-    const char *p = token.value + 2;
-    const char *end = token.value + token.length - 1;
-    int row = 0, col = 0;
-    while (p < end && *p != ';')
-      row = row * 10 + (*p++ - '0');
-    if (p < end)
-      p++;
-    while (p < end)
-      col = col * 10 + (*p++ - '0');
-    if (row < 1)
-      row = 1;
-    if (col < 1)
-      col = 1;
-    (*cursor)->y = row - 1;
-    (*cursor)->x = col - 1;
-  } else {
-    char repr[128];
-    token_repr(&token, repr, sizeof(repr));
-    LOG_WARNING_MSG("unhandled CSI sequence: %s", repr);
   }
+  update_cursor_attr(terminal, cursor);
 }
 
-static int csi_param(Term_Token token, int default_val) {
-  if (token.length < 3)
-    return default_val;
-  char buf[32];
-  int param_len = token.length - 3;
-  if (param_len <= 0)
-    return default_val;
-  if (param_len >= (int)sizeof(buf))
-    param_len = (int)sizeof(buf) - 1;
-  memcpy(buf, &token.value[2], param_len);
-  buf[param_len] = '\0';
-  int val = atoi(buf);
-  return val <= 0 ? default_val : val;
+static void csi_cursor_up(Terminal *terminal, Term_Screen *screen,
+                          const Term_Csi *csi) {
+  (void)terminal;
+  screen->cursor.y -= csi_arg(csi, 0, 1);
+  if (screen->cursor.y < 0)
+    screen->cursor.y = 0;
 }
 
-static int incomplete_escape_tail(const char *buf, int len) {
-  int i = len - 1;
-  while (i >= 0 && (unsigned char)buf[i] != 0x1b)
-    i--;
-  if (i < 0)
-    return 0;
+static void csi_cursor_down(Terminal *terminal, Term_Screen *screen,
+                            const Term_Csi *csi) {
+  screen->cursor.y += csi_arg(csi, 0, 1);
+  if (screen->cursor.y >= terminal->dims.height)
+    screen->cursor.y = terminal->dims.height - 1;
+}
 
-  int have = len - i;
-  const char *p = buf + i;
-
-  if (have == 1)
-    return 1;
-
-  unsigned char next = (unsigned char)p[1];
-  if (next == '[') {
-    int j = 2;
-    while (j < have && (unsigned char)p[j] >= 0x30 &&
-           (unsigned char)p[j] <= 0x3f)
-      j++;
-    while (j < have && (unsigned char)p[j] >= 0x20 &&
-           (unsigned char)p[j] <= 0x2f)
-      j++;
-    if (j < have && (unsigned char)p[j] >= 0x40 && (unsigned char)p[j] <= 0x7e)
-      return 0;
-    return have;
-  } else if (next == ']') {
-    for (int j = 2; j < have; j++) {
-      if ((unsigned char)p[j] == 0x07)
-        return 0;
-      if (j + 1 < have && p[j] == '\x1b' && p[j + 1] == '\\')
-        return 0;
-    }
-    return have;
-  } else if (next == '(' || next == ')' || next == '*' || next == '+') {
-    return (have >= 3) ? 0 : have;
-  }
-  return 0;
+static void csi_cursor_forward(Terminal *terminal, Term_Screen *screen,
+                               const Term_Csi *csi) {
+  screen->cursor.x += csi_arg(csi, 0, 1);
+  if (screen->cursor.x >= terminal->dims.width)
+    screen->cursor.x = terminal->dims.width - 1;
 }
 
-static void handle_csi(Terminal *terminal, Term_Screen *screen,
-                       Term_Token token) {
+static void csi_cursor_back(Terminal *terminal, Term_Screen *screen,
+                            const Term_Csi *csi) {
+  (void)terminal;
+  screen->cursor.x -= csi_arg(csi, 0, 1);
+  if (screen->cursor.x < 0)
+    screen->cursor.x = 0;
+}
+
+static void csi_next_line(Terminal *terminal, Term_Screen *screen,
+                          const Term_Csi *csi) {
+  csi_cursor_down(terminal, screen, csi);
+  screen->cursor.x = 0;
+}
+
+static void csi_prev_line(Terminal *terminal, Term_Screen *screen,
+                          const Term_Csi *csi) {
+  csi_cursor_up(terminal, screen, csi);
+  screen->cursor.x = 0;
+}
+
+static void csi_column(Terminal *terminal, Term_Screen *screen,
+                       const Term_Csi *csi) {
+  screen->cursor.x = csi_arg(csi, 0, 1) - 1;
+  if (screen->cursor.x >= terminal->dims.width)
+    screen->cursor.x = terminal->dims.width - 1;
+}
+
+static void csi_row(Terminal *terminal, Term_Screen *screen,
+                    const Term_Csi *csi) {
+  screen->cursor.y = csi_arg(csi, 0, 1) - 1;
+  if (screen->cursor.y >= terminal->dims.height)
+    screen->cursor.y = terminal->dims.height - 1;
+}
+
+static void csi_position(Terminal *terminal, Term_Screen *screen,
+                         const Term_Csi *csi) {
+  int row = csi_arg(csi, 0, 1);
+  int col = csi_arg(csi, 1, 1);
+  if (row > terminal->dims.height)
+    row = terminal->dims.height;
+  if (col > terminal->dims.width)
+    col = terminal->dims.width;
+  screen->cursor.y = row - 1;
+  screen->cursor.x = col - 1;
+}
+
+static void csi_save_cursor(Terminal *terminal, Term_Screen *screen,
+                            const Term_Csi *csi) {
+  (void)terminal;
+  (void)csi;
+  screen->saved_cursor = screen->cursor;
+}
+
+static void csi_restore_cursor(Terminal *terminal, Term_Screen *screen,
+                               const Term_Csi *csi) {
+  (void)terminal;
+  (void)csi;
+  screen->cursor = screen->saved_cursor;
+}
+
+static void csi_insert_lines(Terminal *terminal, Term_Screen *screen,
+                             const Term_Csi *csi) {
+  int width = terminal->dims.width;
+  Term_Cursor *cursor = &screen->cursor;
+  int n = csi_arg(csi, 0, 1);
+  int bot = screen->scroll_bot;
+  int rows = n < (bot - cursor->y + 1) ? n : (bot - cursor->y + 1);
+  if (rows <= 0)
+    return;
+  rotate_lines(screen, cursor->y, bot, -rows);
+  clear_lines(screen, cursor->y, cursor->y + rows - 1, width,
+              cursor->bg_attr_id);
+}
+
+static void csi_delete_lines(Terminal *terminal, Term_Screen *screen,
+                             const Term_Csi *csi) {
+  int width = terminal->dims.width;
+  Term_Cursor *cursor = &screen->cursor;
+  int n = csi_arg(csi, 0, 1);
+  int bot = screen->scroll_bot;
+  int rows = n < (bot - cursor->y + 1) ? n : (bot - cursor->y + 1);
+  if (rows <= 0)
+    return;
+  rotate_lines(screen, cursor->y, bot, rows);
+  clear_lines(screen, bot - rows + 1, bot, width, cursor->bg_attr_id);
+}
+
+static void csi_scroll_up(Terminal *terminal, Term_Screen *screen,
+                          const Term_Csi *csi) {
+  int n = csi_arg(csi, 0, 1);
+  int top = screen->scroll_top;
+  int bot = screen->scroll_bot;
+  int scroll_n = n < (bot - top + 1) ? n : (bot - top + 1);
+  for (int j = 0; j < scroll_n; j++)
+    scroll_screen(screen, terminal->dims.width, terminal->dims.height);
+}
+
+static void csi_scroll_down(Terminal *terminal, Term_Screen *screen,
+                            const Term_Csi *csi) {
   int width = terminal->dims.width;
+  int n = csi_arg(csi, 0, 1);
+  int top = screen->scroll_top;
+  int bot = screen->scroll_bot;
+  int scroll_n = n < (bot - top + 1) ? n : (bot - top + 1);
+  rotate_lines(screen, top, bot, -scroll_n);
+  clear_lines(screen, top, top + scroll_n - 1, width,
+              screen->cursor.bg_attr_id);
+}
+
+static void csi_scroll_region(Terminal *terminal, Term_Screen *screen,
+                              const Term_Csi *csi) {
   int height = terminal->dims.height;
+  int top = csi_arg(csi, 0, 1);
+  int bot = csi_arg(csi, 1, height);
+  if (bot > height)
+    bot = height;
+  if (top < bot) {
+    screen->scroll_top = top - 1;
+    screen->scroll_bot = bot - 1;
+  }
+  screen->cursor.x = 0;
+  screen->cursor.y = 0;
+}
+
+static void csi_insert_chars(Terminal *terminal, Term_Screen *screen,
+                             const Term_Csi *csi) {
+  int width = terminal->dims.width;
   Term_Cursor *cursor = &screen->cursor;
-  char final = token.value[token.length - 1];
-  int n = csi_param(token, 1);
-
-  if (final == 'A') {
-    cursor->y -= n;
-    if (cursor->y < 0)
-      cursor->y = 0;
-  } else if (final == 'B') {
-    cursor->y += n;
-    if (cursor->y >= height)
-      cursor->y = height - 1;
-  } else if (final == 'C') {
-    cursor->x += n;
-    if (cursor->x >= width)
-      cursor->x = width - 1;
-  } else if (final == 'D') {
-    cursor->x -= n;
-    if (cursor->x < 0)
-      cursor->x = 0;
-  } else if (final == 'E') {
-    cursor->y += n;
-    if (cursor->y >= height)
-      cursor->y = height - 1;
-    cursor->x = 0;
-  } else if (final == 'F') {
-    cursor->y -= n;
-    if (cursor->y < 0)
-      cursor->y = 0;
-    cursor->x = 0;
-  } else if (final == 'G') {
-    cursor->x = n - 1;
-    if (cursor->x < 0)
-      cursor->x = 0;
-    if (cursor->x >= width)
-      cursor->x = width - 1;
-  } else if (final == 'd') {
-    cursor->y = n - 1;
-    if (cursor->y < 0)
-      cursor->y = 0;
-    if (cursor->y >= height)
-      cursor->y = height - 1;
-  } else if (final == '7' || final == 's') {
-    screen->saved_cursor = *cursor;
-  } else if (final == '8' || final == 'u') {
-    *cursor = screen->saved_cursor;
-  } else if (final == 'L') {
-    int bot = screen->scroll_bot;
-    int rows = n < (bot - cursor->y + 1) ? n : (bot - cursor->y + 1);
-    for (int j = bot; j >= cursor->y + rows; j--)
-      memcpy(screen->lines[j].cells, screen->lines[j - rows].cells,
-             width * sizeof(Term_Cell));
-    Term_Cell blank_l = {0};
-    blank_l.attr.bg = cursor->attr.bg;
-    for (int j = cursor->y; j < cursor->y + rows; j++)
-      for (int k = 0; k < width; k++)
-        screen->lines[j].cells[k] = blank_l;
-  } else if (final == 'M') {
-    int bot = screen->scroll_bot;
-    int rows = n < (bot - cursor->y + 1) ? n : (bot - cursor->y + 1);
-    for (int j = cursor->y; j <= bot - rows; j++)
-      memcpy(screen->lines[j].cells, screen->lines[j + rows].cells,
-             width * sizeof(Term_Cell));
-    Term_Cell blank_m = {0};
-    blank_m.attr.bg = cursor->attr.bg;
-    for (int j = bot - rows + 1; j <= bot; j++)
-      for (int k = 0; k < width; k++)
-        screen->lines[j].cells[k] = blank_m;
-  } else if (final == 'S') {
-    int top = screen->scroll_top;
-    int bot = screen->scroll_bot;
-    int scroll_n = n < (bot - top + 1) ? n : (bot - top + 1);
-    for (int j = 0; j < scroll_n; j++)
-      scroll_screen(screen, width, height);
-  } else if (final == 'T') {
-    int top = screen->scroll_top;
-    int bot = screen->scroll_bot;
-    int scroll_n = n < (bot - top + 1) ? n : (bot - top + 1);
-    for (int j = bot; j >= top + scroll_n; j--)
-      memcpy(screen->lines[j].cells, screen->lines[j - scroll_n].cells,
-             width * sizeof(Term_Cell));
-    Term_Cell blank_t = {0};
-    blank_t.attr.bg = cursor->attr.bg;
-    for (int j = top; j < top + scroll_n; j++)
-      for (int k = 0; k < width; k++)
-        screen->lines[j].cells[k] = blank_t;
-  } else if (final == 'r') {
-    const char *p = token.value + 2;
-    const char *end = token.value + token.length - 1;
-    int top = 0, bot = 0;
-    while (p < end && *p != ';')
-      top = top * 10 + (*p++ - '0');
-    if (p < end)
-      p++;
-    while (p < end)
-      bot = bot * 10 + (*p++ - '0');
-    if (top < 1)
-      top = 1;
-    if (bot < 1 || bot > height)
-      bot = height;
-    if (top < bot) {
-      screen->scroll_top = top - 1;
-      screen->scroll_bot = bot - 1;
-    }
-    cursor->x = 0;
-    cursor->y = 0;
-  } else if (final == '@') {
-    int cols = (n < width - cursor->x) ? n : width - cursor->x;
-    int move = width - cursor->x - cols;
-    if (move > 0)
-      memmove(&screen->lines[cursor->y].cells[cursor->x + cols],
-              &screen->lines[cursor->y].cells[cursor->x],
-              move * sizeof(Term_Cell));
-    for (int k = cursor->x; k < cursor->x + cols; k++)
-      memset(&screen->lines[cursor->y].cells[k], 0, sizeof(Term_Cell));
-  } else if (final == 'P') {
-    int cols = (n < width - cursor->x) ? n : width - cursor->x;
-    int move = width - cursor->x - cols;
-    if (move > 0)
-      memmove(&screen->lines[cursor->y].cells[cursor->x],
-              &screen->lines[cursor->y].cells[cursor->x + cols],
-              move * sizeof(Term_Cell));
-    for (int k = width - cols; k < width; k++)
-      memset(&screen->lines[cursor->y].cells[k], 0, sizeof(Term_Cell));
-  } else if (final == 'X') {
-    int cols = (n < width - cursor->x) ? n : width - cursor->x;
-    for (int k = cursor->x; k < cursor->x + cols; k++)
-      memset(&screen->lines[cursor->y].cells[k], 0, sizeof(Term_Cell));
-  } else if (final == 'J') {
-    int nj = csi_param(token, 0);
-    if (nj == 0) {
-      handle_erase(screen, TOKEN_ERASE_DOWN, width, height);
-    } else if (nj == 1) {
-      handle_erase(screen, TOKEN_ERASE_UP, width, height);
-    } else if (nj == 2) {
-      handle_erase(screen, TOKEN_ERASE_ALL, width, height);
-    } else if (nj == 3) {
-      handle_erase(screen, TOKEN_ERASE_SCROLLBACK, width, height);
-    }
-  } else if (final == 'K') {
-    int nk = csi_param(token, 0);
-    if (nk == 0) {
-      handle_erase(screen, TOKEN_ERASE_EOL, width, height);
-    } else if (nk == 1) {
-      handle_erase(screen, TOKEN_ERASE_SOL, width, height);
-    } else if (nk == 2) {
-      handle_erase(screen, TOKEN_ERASE_LINE, width, height);
-    }
-  } else if (final == 'h' || final == 'l') {
-    bool enable = (final == 'h');
-    if (starts_with(token.value, token.length, "\x1b[?1000"))
-      terminal->modes.mouse_mode = enable ? 1 : 0;
-    else if (starts_with(token.value, token.length, "\x1b[?1002"))
-      terminal->modes.mouse_mode = enable ? 2 : 0;
-    else if (starts_with(token.value, token.length, "\x1b[?1003"))
-      terminal->modes.mouse_mode = enable ? 3 : 0;
-    else if (starts_with(token.value, token.length, "\x1b[?1006"))
-      terminal->modes.mouse_sgr = enable;
-    else if (starts_with(token.value, token.length, "\x1b[?1049")) {
-      if (enable && !terminal->screens.using_alt_screen)
-        terminal->screens.screen.saved_cursor = terminal->screens.screen.cursor;
-      terminal->screens.using_alt_screen = enable;
-      if (!enable)
-        terminal->screens.screen.cursor = terminal->screens.screen.saved_cursor;
-    } else if (starts_with(token.value, token.length, "\x1b[?12"))
-      terminal->modes.cursor_blink = enable;
-    else if (starts_with(token.value, token.length, "\x1b[?25"))
-      screen->cursor_hidden = !enable;
-    else if (starts_with(token.value, token.length, "\x1b[?2004"))
-      terminal->modes.bracketed_paste = enable;
-  } else if (final == 't') {
-    const char *p = token.value + 2;
-    const char *end = token.value + token.length - 1;
-    int n1 = 0, n2 = 0;
-    while (p < end && *p >= '0' && *p <= '9')
-      n1 = n1 * 10 + (*p++ - '0');
-    if (p < end && *p == ';') {
-      p++;
-      while (p < end && *p >= '0' && *p <= '9')
-        n2 = n2 * 10 + (*p++ - '0');
-    }
-    if (n1 == 22) {
-      if (n2 == 0 || n2 == 2) {
-        if (terminal->title.window_title_stack_depth < 32) {
-          memcpy(
-              terminal->title.window_title_stack[terminal->title.window_title_stack_depth],
-              terminal->title.window_title, 256);
-          terminal->title.window_title_stack_depth++;
-        }
-      }
-      if (n2 == 0 || n2 == 1) {
-        if (terminal->title.icon_name_stack_depth < 32) {
-          memcpy(terminal->title.icon_name_stack[terminal->title.icon_name_stack_depth],
-                 terminal->title.icon_name, 256);
-          terminal->title.icon_name_stack_depth++;
-        }
+  int n = csi_arg(csi, 0, 1);
+  int cols = (n < width - cursor->x) ? n : width - cursor->x;
+  int move = width - cursor->x - cols;
+  if (move > 0)
+    memmove(&screen_line(screen, cursor->y)[cursor->x + cols],
+            &screen_line(screen, cursor->y)[cursor->x],
+            move * sizeof(Term_Cell));
+  for (int k = cursor->x; k < cursor->x + cols; k++)
+    memset(&screen_line(screen, cursor->y)[k], 0, sizeof(Term_Cell));
+  damage_cells(screen, cursor->y, cursor->x, width - 1);
+}
+
+static void csi_delete_chars(Terminal *terminal, Term_Screen *screen,
+                             const Term_Csi *csi) {
+  int width = terminal->dims.width;
+  Term_Cursor *cursor = &screen->cursor;
+  int n = csi_arg(csi, 0, 1);
+  int cols = (n < width - cursor->x) ? n : width - cursor->x;
+  int move = width - cursor->x - cols;
+  if (move > 0)
+    memmove(&screen_line(screen, cursor->y)[cursor->x],
+            &screen_line(screen, cursor->y)[cursor->x + cols],
+            move * sizeof(Term_Cell));
+  for (int k = width - cols; k < width; k++)
+    memset(&screen_line(screen, cursor->y)[k], 0, sizeof(Term_Cell));
+  damage_cells(screen, cursor->y, cursor->x, width - 1);
+}
+
+static void csi_erase_chars(Terminal *terminal, Term_Screen *screen,
+                            const Term_Csi *csi) {
+  int width = terminal->dims.width;
+  Term_Cursor *cursor = &screen->cursor;
+  int n = csi_arg(csi, 0, 1);
+  int cols = (n < width - cursor->x) ? n : width - cursor->x;
+  for (int k = cursor->x; k < cursor->x + cols; k++)
+    memset(&screen_line(screen, cursor->y)[k], 0, sizeof(Term_Cell));
+  damage_cells(screen, cursor->y, cursor->x, cursor->x + cols - 1);
+}
+
+static void csi_erase_display(Terminal *terminal, Term_Screen *screen,
+                              const Term_Csi *csi) {
+  static const Term_EraseMode erase[] = {ERASE_DOWN, ERASE_UP, ERASE_ALL,
+                                         ERASE_SCROLLBACK};
+  int mode = csi_arg(csi, 0, 0);
+  if (mode <= 3)
+    handle_erase(screen, erase[mode], terminal->dims.width,
+                 terminal->dims.height);
+}
+
+static void csi_erase_line(Terminal *terminal, Term_Screen *screen,
+                           const Term_Csi *csi) {
+  static const Term_EraseMode erase[] = {ERASE_EOL, ERASE_SOL, ERASE_LINE};
+  int mode = csi_arg(csi, 0, 0);
+  if (mode <= 2)
+    handle_erase(screen, erase[mode], terminal->dims.width,
+                 terminal->dims.height);
+}
+
+static void mode_cursor_blink(Terminal *terminal, Term_Screen *screen,
+                              bool enable) {
+  (void)screen;
+  terminal->modes.cursor_blink = enable;
+}
+
+static void mode_cursor_visible(Terminal *terminal, Term_Screen *screen,
+                                bool enable) {
+  (void)terminal;
+  screen->cursor_hidden = !enable;
+}
+
+static void mode_mouse_click(Terminal *terminal, Term_Screen *screen,
+                             bool enable) {
+  (void)screen;
+  terminal->modes.mouse_mode = enable ? 1 : 0;
+}
+
+static void mode_mouse_button(Terminal *terminal, Term_Screen *screen,
+                              bool enable) {
+  (void)screen;
+  terminal->modes.mouse_mode = enable ? 2 : 0;
+}
+
+static void mode_mouse_any(Terminal *terminal, Term_Screen *screen,
+                           bool enable) {
+  (void)screen;
+  terminal->modes.mouse_mode = enable ? 3 : 0;
+}
+
+static void mode_mouse_sgr(Terminal *terminal, Term_Screen *screen,
+                           bool enable) {
+  (void)screen;
+  terminal->modes.mouse_sgr = enable;
+}
+
+// The alternate screen's grid is only allocated while it is in use, and it
+// keeps no scrollback
+static void mode_alt_screen(Terminal *terminal, Term_Screen *screen,
+                            bool enable) {
+  (void)screen;
+  Term_Screens *screens = &terminal->screens;
+  if (enable && !screens->using_alt_screen) {
+    screens->screen.saved_cursor = screens->screen.cursor;
+    init_screen(&screens->alt_screen, terminal->dims.width,
+                terminal->dims.height, 0);
+    screens->alt_screen.ambiguous_wide = screens->screen.ambiguous_wide;
+  } else if (!enable && screens->using_alt_screen) {
+    free_screen(&screens->alt_screen, terminal->dims.height);
+    damage_screen(&screens->screen);
+  }
+  screens->using_alt_screen = enable;
+  if (!enable)
+    screens->screen.cursor = screens->screen.saved_cursor;
+}
+
+static void mode_bracketed_paste(Terminal *terminal, Term_Screen *screen,
+                                 bool enable) {
+  (void)screen;
+  terminal->modes.bracketed_paste = enable;
+}
+
+static void mode_synchronized(Terminal *terminal, Term_Screen *screen,
+                              bool enable) {
+  (void)screen;
+  if (enable)
+    terminal->modes.sync_begun = true;
+  terminal->modes.synchronized = enable;
+}
+
+// DEC private modes understood by DECSET/DECRST, sorted by mode number
+static const struct {
+  int mode;
+  void (*set)(Terminal *terminal, Term_Screen *screen, bool enable);
+} dec_modes[] = {
+    {12, mode_cursor_blink},    {25, mode_cursor_visible},
+    {1000, mode_mouse_click},   {1002, mode_mouse_button},
+    {1003, mode_mouse_any},     {1006, mode_mouse_sgr},
+    {1049, mode_alt_screen},    {2004, mode_bracketed_paste},
+    {2026, mode_synchronized},
+};
+
+// DECRQM value of a DEC private mode: 1 set, 2 reset, 0 not recognized
+static int dec_mode_state(Terminal *terminal, Term_Screen *screen, int mode) {
+  bool set;
+  switch (mode) {
+  case 12:
+    set = terminal->modes.cursor_blink;
+    break;
+  case 25:
+    set = !screen->cursor_hidden;
+    break;
+  case 1000:
+  case 1002:
+  case 1003:
+    set = terminal->modes.mouse_mode == (mode == 1000 ? 1 : mode - 1000);
+    break;
+  case 1006:
+    set = terminal->modes.mouse_sgr;
+    break;
+  case 1049:
+    set = terminal->screens.using_alt_screen;
+    break;
+  case 2004:
+    set = terminal->modes.bracketed_paste;
+    break;
+  case 2026:
+    set = terminal->modes.synchronized;
+    break;
+  default:
+    return 0;
+  }
+  return set ? 1 : 2;
+}
+
+static void set_dec_modes(Terminal *terminal, Term_Screen *screen,
+                          const Term_Csi *csi, bool enable) {
+  int count = (int)(sizeof(dec_modes) / sizeof(dec_modes[0]));
+  for (int i = 0; i < csi->param_count; i++) {
+    int m = 0;
+    while (m < count && dec_modes[m].mode < csi->params[i])
+      m++;
+    if (m < count && dec_modes[m].mode == csi->params[i])
+      dec_modes[m].set(terminal, screen, enable);
+    else
+      LOG_DEBUG_MSG("unhandled DEC private mode %d", csi->params[i]);
+  }
+}
+
+static void csi_decset(Terminal *terminal, Term_Screen *screen,
+                       const Term_Csi *csi) {
+  if (csi->private_marker == '?')
+    set_dec_modes(terminal, screen, csi, true);
+}
+
+static void csi_decrst(Terminal *terminal, Term_Screen *screen,
+                       const Term_Csi *csi) {
+  if (csi->private_marker == '?')
+    set_dec_modes(terminal, screen, csi, false);
+}
+
+static void csi_window_ops(Terminal *terminal, Term_Screen *screen,
+                           const Term_Csi *csi) {
+  (void)screen;
+  int n1 = csi_arg(csi, 0, 0);
+  int n2 = csi_arg(csi, 1, 0);
+  if (n1 == 22) {
+    if (n2 == 0 || n2 == 2) {
+      if (terminal->title.window_title_stack_depth < 32) {
+        memcpy(
+            terminal->title.window_title_stack[terminal->title.window_title_stack_depth],
+            terminal->title.window_title, 256);
+        terminal->title.window_title_stack_depth++;
       }
-    } else if (n1 == 23) {
-      if (n2 == 0 || n2 == 2) {
-        if (terminal->title.window_title_stack_depth > 0) {
-          terminal->title.window_title_stack_depth--;
-          memcpy(
-              terminal->title.window_title,
-              terminal->title.window_title_stack[terminal->title.window_title_stack_depth],
-              256);
-          terminal->title.title_dirty = true;
-        }
+    }
+    if (n2 == 0 || n2 == 1) {
+      if (terminal->title.icon_name_stack_depth < 32) {
+        memcpy(terminal->title.icon_name_stack[terminal->title.icon_name_stack_depth],
+               terminal->title.icon_name, 256);
+        terminal->title.icon_name_stack_depth++;
       }
-      if (n2 == 0 || n2 == 1) {
-        if (terminal->title.icon_name_stack_depth > 0) {
-          terminal->title.icon_name_stack_depth--;
-          memcpy(terminal->title.icon_name,
-                 terminal->title.icon_name_stack[terminal->title.icon_name_stack_depth],
-                 256);
-          terminal->title.title_dirty = true;
-        }
+    }
+  } else if (n1 == 23) {
+    if (n2 == 0 || n2 == 2) {
+      if (terminal->title.window_title_stack_depth > 0) {
+        terminal->title.window_title_stack_depth--;
+        memcpy(
+            terminal->title.window_title,
+            terminal->title.window_title_stack[terminal->title.window_title_stack_depth],
+            256);
+        terminal->title.title_dirty = true;
       }
     }
-  } else if (final == 'n') {
-    if (n == 6) {
-      char buf[32];
-      int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dR", cursor->y + 1,
-                         cursor->x + 1);
-      terminal_respond(terminal, buf, len);
+    if (n2 == 0 || n2 == 1) {
+      if (terminal->title.icon_name_stack_depth > 0) {
+        terminal->title.icon_name_stack_depth--;
+        memcpy(terminal->title.icon_name,
+               terminal->title.icon_name_stack[terminal->title.icon_name_stack_depth],
+               256);
+        terminal->title.title_dirty = true;
+      }
     }
-  } else if (final == 'c') {
+  }
+}
+
+static void csi_status_report(Terminal *terminal, Term_Screen *screen,
+                              const Term_Csi *csi) {
+  if (csi_arg(csi, 0, 0) == 6) {
     char buf[32];
-    int len;
-    if (starts_with(token.value, token.length, "\x1b[>"))
-      len = snprintf(buf, sizeof(buf), "\x1b[>0;0;0c");
-    else
-      len = snprintf(buf, sizeof(buf), "\x1b[?1;0c");
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dR", screen->cursor.y + 1,
+                       screen->cursor.x + 1);
     terminal_respond(terminal, buf, len);
-  } else if (final == 'q') {
-    if (token.length >= 3 && token.value[token.length - 2] == ' ')
-      terminal->modes.cursor_shape = csi_param(token, 0);
+  }
+}
+
+static void csi_device_attributes(Terminal *terminal, Term_Screen *screen,
+                                  const Term_Csi *csi) {
+  (void)screen;
+  char buf[32];
+  int len;
+  if (csi->private_marker == '>')
+    len = snprintf(buf, sizeof(buf), "\x1b[>0;0;0c");
+  else if (csi->private_marker == 0)
+    len = snprintf(buf, sizeof(buf), "\x1b[?1;0c");
+  else
+    return;
+  terminal_respond(terminal, buf, len);
+}
+
+static void csi_cursor_style(Terminal *terminal, Term_Screen *screen,
+                             const Term_Csi *csi) {
+  (void)screen;
+  if (csi->intermediate_count == 1 && csi->intermediates[0] == ' ')
+    terminal->modes.cursor_shape = csi_arg(csi, 0, 0);
+}
+
+// DECRQM: CSI ? Ps $ p for DEC private modes, CSI Ps $ p for ANSI modes,
+// none of which are tracked
+static void csi_request_mode(Terminal *terminal, Term_Screen *screen,
+                             const Term_Csi *csi) {
+  if (csi->intermediate_count != 1 || csi->intermediates[0] != '$')
+    return;
+  if (csi->private_marker != 0 && csi->private_marker != '?')
+    return;
+  int mode = csi_arg(csi, 0, 0);
+  bool dec = csi->private_marker == '?';
+  char buf[32];
+  int len = snprintf(buf, sizeof(buf), "\x1b[%s%d;%d$y", dec ? "?" : "", mode,
+                     dec ? dec_mode_state(terminal, screen, mode) : 0);
+  terminal_respond(terminal, buf, len);
+}
+
+// Handlers for CSI sequences without a private marker, by final byte
+static const Term_CsiHandler csi_handlers[256] = {
+    ['@'] = csi_insert_chars,   ['A'] = csi_cursor_up,
+    ['B'] = csi_cursor_down,    ['C'] = csi_cursor_forward,
+    ['D'] = csi_cursor_back,    ['E'] = csi_next_line,
+    ['F'] = csi_prev_line,      ['G'] = csi_column,
+    ['H'] = csi_position,       ['J'] = csi_erase_display,
+    ['K'] = csi_erase_line,     ['L'] = csi_insert_lines,
+    ['M'] = csi_delete_lines,   ['P'] = csi_delete_chars,
+    ['S'] = csi_scroll_up,      ['T'] = csi_scroll_down,
+    ['X'] = csi_erase_chars,    ['c'] = csi_device_attributes,
+    ['d'] = csi_row,            ['f'] = csi_position,
+    ['m'] = csi_sgr,            ['n'] = csi_status_report,
+    ['p'] = csi_request_mode,   ['q'] = csi_cursor_style,
+    ['r'] = csi_scroll_region,  ['s'] = csi_save_cursor,
+    ['t'] = csi_window_ops,     ['u'] = csi_restore_cursor,
+};
+
+// Handlers for CSI sequences with a '<', '=', '>' or '?' marker
+static const Term_CsiHandler csi_private_handlers[256] = {
+    ['J'] = csi_erase_display,  ['K'] = csi_erase_line,
+    ['c'] = csi_device_attributes, ['h'] = csi_decset,
+    ['l'] = csi_decrst,         ['p'] = csi_request_mode,
+};
+
+static void handle_csi(Terminal *terminal, Term_Screen *screen,
+                       Term_Token token) {
+  const Term_Csi *csi = token.csi;
+  const Term_CsiHandler *table =
+      csi->private_marker ? csi_private_handlers : csi_handlers;
+  Term_CsiHandler handler = table[(unsigned char)csi->final];
+  if (handler) {
+    handler(terminal, screen, csi);
   } else {
-    modify_cursor(&cursor, token);
+    char repr[128];
+    token_repr(&token, repr, sizeof(repr));
+    LOG_WARNING_MSG("unhandled CSI sequence: %s", repr);
   }
 }
 
@@ -590,7 +789,7 @@ static int base64_decode(const char *in, int in_len, char **out) {
     int v = base64_digit((unsigned char)in[i]);
     if (v < 0)
       continue;
-    acc = (acc << 6) | v;
+    acc = ((acc & 0xffff) << 6) | v;
     acc_bits += 6;
     if (acc_bits >= 8) {
       acc_bits -= 8;
@@ -719,6 +918,7 @@ static void handle_osc(Terminal *terminal, Term_Token token) {
         if ((int)strlen(terminal->uri.uri_table[k]) == uri_len &&
             memcmp(terminal->uri.uri_table[k], uri, uri_len) == 0) {
           as->cursor.attr.uri_idx = (uint16_t)(k + 1);
+          update_cursor_attr(terminal, &as->cursor);
           return;
         }
       }
@@ -732,6 +932,7 @@ static void handle_osc(Terminal *terminal, Term_Token token) {
         }
       }
     }
+    update_cursor_attr(terminal, &as->cursor);
   } else if (cmd == 7) {
     // OSC 7: current working directory notification (unused)
   } else if (cmd == 133) {
@@ -761,57 +962,56 @@ static void handle_osc(Terminal *terminal, Term_Token token) {
   }
 }
 
-static void handle_erase(Term_Screen *screen, Term_TokenType type, int width,
+static void handle_erase(Term_Screen *screen, Term_EraseMode mode, int width,
                          int height) {
   Term_Cursor *cursor = &screen->cursor;
   Term_Cell blank = {0};
-  blank.attr.bg = cursor->attr.bg;
-  switch (type) {
-  case TOKEN_ERASE_EOL:
+  blank.attr = cursor->bg_attr_id;
+  switch (mode) {
+  case ERASE_EOL:
     for (int j = cursor->x; j < width; j++)
-      screen->lines[cursor->y].cells[j] = blank;
+      screen_line(screen, cursor->y)[j] = blank;
+    damage_cells(screen, cursor->y, cursor->x, width - 1);
     break;
-  case TOKEN_ERASE_SOL:
+  case ERASE_SOL:
     for (int j = 0; j <= cursor->x; j++)
-      screen->lines[cursor->y].cells[j] = blank;
+      screen_line(screen, cursor->y)[j] = blank;
+    damage_cells(screen, cursor->y, 0, cursor->x);
     break;
-  case TOKEN_ERASE_LINE:
+  case ERASE_LINE:
     for (int j = 0; j < width; j++)
-      screen->lines[cursor->y].cells[j] = blank;
+      screen_line(screen, cursor->y)[j] = blank;
+    damage_lines(screen, cursor->y, cursor->y);
     break;
-  case TOKEN_ERASE_DOWN:
+  case ERASE_DOWN:
     for (int j = cursor->y; j < height; j++)
       for (int k = 0; k < width; k++) {
         if (j == cursor->y && k < cursor->x)
           continue;
-        screen->lines[j].cells[k] = blank;
+        screen_line(screen, j)[k] = blank;
       }
+    damage_lines(screen, cursor->y, height - 1);
     break;
-  case TOKEN_ERASE_UP:
+  case ERASE_UP:
     for (int j = 0; j <= cursor->y; j++)
       for (int k = 0; k < width; k++) {
         if (j == cursor->y && k > cursor->x)
           continue;
-        screen->lines[j].cells[k] = blank;
+        screen_line(screen, j)[k] = blank;
       }
+    damage_lines(screen, 0, cursor->y);
     break;
-  case TOKEN_ERASE_ALL:
+  case ERASE_ALL:
     for (int j = 0; j < height; j++)
       for (int k = 0; k < width; k++)
-        screen->lines[j].cells[k] = blank;
+        screen_line(screen, j)[k] = blank;
+    damage_lines(screen, 0, height - 1);
     break;
-  case TOKEN_ERASE_SCROLLBACK: {
-    Term_Scrollback *sb = &screen->scrollback;
-    for (int i = 0; i < sb->count; i++)
-      free(sb->lines[(sb->head + i) % sb->capacity]);
-    sb->count = 0;
-    sb->head = 0;
+  case ERASE_SCROLLBACK:
+    clear_scrollback(&screen->scrollback);
     screen->scroll_offset = 0;
     break;
   }
-  default:
-    break;
-  }
 }
 
 void free_terminal(Terminal *terminal) {
@@ -820,6 +1020,9 @@ void free_terminal(Terminal *terminal) {
   free(terminal->osc.osc52_text);
   for (int i = 0; i < terminal->uri.uri_count; i++)
     free(terminal->uri.uri_table[i]);
+  free_parser(&terminal->parser);
+  free_attrs(&terminal->attrs);
+  free_clusters(&terminal->clusters);
 }
 
 void init_terminal(Terminal *terminal, int width, int height,
@@ -830,7 +1033,8 @@ void init_terminal(Terminal *terminal, int width, int height,
   terminal->title.window_title[0] = '\0';
   terminal->title.icon_name[0] = '\0';
   terminal->title.title_dirty = false;
-  terminal->parser.partial_len = 0;
+  memset(&terminal->parser, 0, sizeof(terminal->parser));
+  terminal->parser.max_sequence = PARSER_MAX_SEQUENCE;
   terminal->modes.bracketed_paste = false;
   terminal->modes.mouse_mode = 0;
   terminal->modes.mouse_sgr = false;
@@ -842,6 +1046,8 @@ void init_terminal(Terminal *terminal, int width, int height,
   terminal->modes.cursor_shape = 0;
   terminal->modes.cursor_blink = true;
   terminal->modes.bell_pending = false;
+  terminal->modes.synchronized = false;
+  terminal->modes.sync_begun = false;
   terminal->osc.osc52_text = NULL;
   terminal->osc.osc52_len = 0;
   terminal->osc.osc52_dirty = false;
@@ -851,22 +1057,25 @@ void init_terminal(Terminal *terminal, int width, int height,
   terminal->uri.uri_count = 0;
   terminal->marks.shell_mark_count = 0;
   terminal->marks.shell_mark_head = 0;
+  init_attrs(&terminal->attrs);
+  init_clusters(&terminal->clusters);
   init_screen(&terminal->screens.screen, width, height, scrollback_lines);
-  init_screen(&terminal->screens.alt_screen, width, height, scrollback_lines);
+  memset(&terminal->screens.alt_screen, 0, sizeof(Term_Screen));
 }
 
 void reset_terminal(Terminal *terminal) {
   reset_screen(&terminal->screens.screen, terminal->dims.width, terminal->dims.height);
-  reset_screen(&terminal->screens.alt_screen, terminal->dims.width, terminal->dims.height);
+  free_screen(&terminal->screens.alt_screen, terminal->dims.height);
   terminal->screens.using_alt_screen = false;
   terminal->title.window_title[0] = '\0';
   terminal->title.icon_name[0] = '\0';
   terminal->title.title_dirty = false;
-  terminal->parser.partial_len = 0;
   terminal->modes.bracketed_paste = false;
   terminal->modes.mouse_mode = 0;
   terminal->modes.mouse_sgr = false;
   terminal->modes.cursor_blink = true;
+  terminal->modes.synchronized = false;
+  terminal->modes.sync_begun = false;
   terminal->osc.osc_fg = 0xffffff;
   terminal->osc.fg_dirty = false;
   terminal->osc.osc_bg = 0;
@@ -894,187 +1103,183 @@ void resize_terminal(Terminal *terminal, int new_width, int new_height) {
 
   resize_screen(&terminal->screens.screen, old_width, old_height, new_width,
                 new_height);
-  resize_screen(&terminal->screens.alt_screen, old_width, old_height, new_width,
-                new_height);
+  if (terminal->screens.alt_screen.lines)
+    resize_screen(&terminal->screens.alt_screen, old_width, old_height,
+                  new_width, new_height);
 
   terminal->dims.width = new_width;
   terminal->dims.height = new_height;
 }
 
-static int incomplete_utf8_len(const char *buf, int len) {
+static int utf8_decode(const char *s, int len) {
   if (len <= 0)
-    return 0;
-
-  int i = len - 1;
-  while (i >= 0 && (unsigned char)buf[i] >= 0x80 &&
-         (unsigned char)buf[i] < 0xc0) {
-    i--;
-  }
-
-  if (i < 0) {
-    if (len > 0 && (unsigned char)buf[0] >= 0x80 &&
-        (unsigned char)buf[0] < 0xc0)
-      return len > 3 ? 0 : len;
-    return 0;
-  }
-
-  unsigned char c = (unsigned char)buf[i];
-  int expected = 0;
+    return -1;
+  unsigned char c = (unsigned char)s[0];
   if (c < 0x80)
-    return 0;
-  else if ((c & 0xe0) == 0xc0)
-    expected = 2;
-  else if ((c & 0xf0) == 0xe0)
-    expected = 3;
-  else if ((c & 0xf8) == 0xf0)
-    expected = 4;
-  else
-    return 0;
-
-  int have = len - i;
-  if (have < expected)
-    return have;
-
-  return 0;
+    return c;
+  if ((c & 0xE0) == 0xC0 && len >= 2)
+    return ((c & 0x1F) << 6) | ((unsigned char)s[1] & 0x3F);
+  if ((c & 0xF0) == 0xE0 && len >= 3)
+    return ((c & 0x0F) << 12) | (((unsigned char)s[1] & 0x3F) << 6) |
+           ((unsigned char)s[2] & 0x3F);
+  if ((c & 0xF8) == 0xF0 && len >= 4)
+    return ((c & 0x07) << 18) | (((unsigned char)s[1] & 0x3F) << 12) |
+           (((unsigned char)s[2] & 0x3F) << 6) | ((unsigned char)s[3] & 0x3F);
+  return -1;
 }
 
-void write_terminal(Terminal *terminal, const char *text, int length) {
-  char *combined = NULL;
-  int combined_len = length;
-
-  if (terminal->parser.partial_len > 0) {
-    combined_len = terminal->parser.partial_len + length;
-    combined = malloc(combined_len);
-    if (!combined)
-      return;
-    memcpy(combined, terminal->parser.partial_buf, terminal->parser.partial_len);
-    memcpy(combined + terminal->parser.partial_len, text, length);
-    text = combined;
-    terminal->parser.partial_len = 0;
+// Appends a zero-width character to the cell before the cursor by turning it
+// into an interned cluster. Marks with no base cell, or that don't fit, are
+// dropped.
+static void attach_combining(Terminal *terminal, Term_Screen *screen,
+                             uint32_t cp) {
+  int x = screen->cursor.x - 1;
+  if (x >= terminal->dims.width)
+    x = terminal->dims.width - 1;
+  if (x < 0 || screen->cursor.y >= terminal->dims.height)
+    return;
+  Term_Cell *cell = &screen_line(screen, screen->cursor.y)[x];
+  if ((cell->flags & CELL_WIDE_CONT) && x > 0) {
+    cell--;
+    x--;
   }
 
-  int tail = incomplete_escape_tail(text, combined_len);
-  if (tail <= 0)
-    tail = incomplete_utf8_len(text, combined_len);
-
-  if (tail >= combined_len) {
-    int save = tail < (int)sizeof(terminal->parser.partial_buf)
-                   ? tail
-                   : (int)sizeof(terminal->parser.partial_buf) - 1;
-    memcpy(terminal->parser.partial_buf, text, save);
-    terminal->parser.partial_len = save;
-    free(combined);
+  uint32_t cps[CLUSTER_MAX];
+  int count = cell_codepoints(&terminal->clusters, *cell, cps);
+  if (count == 0 || count == CLUSTER_MAX)
     return;
-  }
-  if (tail > 0) {
-    int save = tail < (int)sizeof(terminal->parser.partial_buf)
-                   ? tail
-                   : (int)sizeof(terminal->parser.partial_buf) - 1;
-    memcpy(terminal->parser.partial_buf, text + combined_len - tail, save);
-    terminal->parser.partial_len = save;
-    combined_len -= tail;
-  }
+  cps[count++] = cp;
+  uint32_t id = intern_cluster(terminal, cps, count);
+  if (id == CLUSTER_NONE)
+    return;
+  cell->cp = id;
+  cell->flags |= CELL_CLUSTER;
+  damage_cells(screen, screen->cursor.y, x, x);
+}
 
-  Term_Tokens *tokens = tokenize(text, combined_len);
-  if (!tokens) {
-    free(combined);
+static void write_char(Terminal *terminal, Term_Screen *screen, int cp) {
+  Term_WidthClass class = width_class(cp);
+  if (class == WIDTH_ZERO) {
+    attach_combining(terminal, screen, cp);
     return;
   }
+  bool wide = class == WIDTH_WIDE ||
+              (class == WIDTH_AMBIGUOUS && screen->ambiguous_wide);
+  // Malformed UTF-8 shows as U+FFFD
+  write_regular_cell(screen, cp < 0 ? 0xFFFD : (uint32_t)cp, wide,
+                     terminal->dims.width, terminal->dims.height,
+                     screen->cursor.attr_id);
+}
+
+static void apply_token(void *ctx, Term_Token token) {
+  Terminal *terminal = ctx;
   int width = terminal->dims.width;
   int height = terminal->dims.height;
-
-  Term_Screen *active =
+  Term_Screen *screen =
       terminal->screens.using_alt_screen ? &terminal->screens.alt_screen : &terminal->screens.screen;
-  active->scroll_offset = 0;
+  Term_Cursor *cursor = &screen->cursor;
 
 #ifdef DEBUG
-  for (int i = 0; i < tokens->count; i++)
-    print_token(tokens->tokens[i]);
+  print_token(token);
 #endif
 
-  for (int i = 0; i < tokens->count; i++) {
-    Term_Token token = tokens->tokens[i];
-    Term_Screen *screen =
-        terminal->screens.using_alt_screen ? &terminal->screens.alt_screen : &terminal->screens.screen;
-    Term_Cursor *cursor = &screen->cursor;
-
-    switch (token.type) {
-    case TOKEN_TEXT: {
-      int j = 0;
-      while (j < token.length) {
-        unsigned char c = (unsigned char)token.value[j];
-        int char_len;
-        if (c < 0x80)
-          char_len = 1;
-        else if (c < 0xE0)
-          char_len = 2;
-        else if (c < 0xF0)
-          char_len = 3;
-        else
-          char_len = 4;
-        if (j + char_len > token.length)
-          char_len = token.length - j;
-        write_regular_cell(screen, &token.value[j], char_len, width, height,
-                           cursor->attr);
-        j += char_len;
-      }
+  switch (token.type) {
+  case TOKEN_TEXT: {
+    if (token.ascii) {
+      write_cell_run(screen, token.value, token.length, width, height,
+                     cursor->attr_id);
       break;
     }
-    case TOKEN_NEWLINE:
-      handle_newline(active, width, height);
-      break;
-    case TOKEN_CARRIAGE_RETURN:
-      cursor->x = 0;
-      break;
-    case TOKEN_CSI_CODE:
-      handle_csi(terminal, active, token);
-      break;
-    case TOKEN_FULL_RESET:
-      reset_terminal(terminal);
-      break;
-    case TOKEN_TAB: {
-      int next_tab_stop = ((cursor->x / 8) + 1) * 8;
-      if (next_tab_stop >= width)
-        handle_newline(active, width, height);
+    int j = 0;
+    while (j < token.length) {
+      int run = 0;
+      while (j + run < token.length &&
+             (unsigned char)token.value[j + run] < 0x80)
+        run++;
+      if (run > 0) {
+        write_cell_run(screen, &token.value[j], run, width, height,
+                       cursor->attr_id);
+        j += run;
+        continue;
+      }
+      unsigned char c = (unsigned char)token.value[j];
+      int char_len;
+      if (c < 0x80)
+        char_len = 1;
+      else if (c < 0xE0)
+        char_len = 2;
+      else if (c < 0xF0)
+        char_len = 3;
       else
-        cursor->x = next_tab_stop;
-      break;
+        char_len = 4;
+      if (j + char_len > token.length)
+        char_len = token.length - j;
+      write_char(terminal, screen, utf8_decode(&token.value[j], char_len));
+      j += char_len;
     }
-    case TOKEN_BACKSPACE:
-      if (cursor->x > 0)
-        cursor->x--;
-      break;
-    case TOKEN_REVERSE_INDEX:
-      if (cursor->y > screen->scroll_top) {
+    break;
+  }
+  case TOKEN_NEWLINE:
+    handle_newline(screen, width, height);
+    break;
+  case TOKEN_CARRIAGE_RETURN:
+    cursor->x = 0;
+    break;
+  case TOKEN_CSI_CODE:
+    handle_csi(terminal, screen, token);
+    break;
+  case TOKEN_FULL_RESET:
+    reset_terminal(terminal);
+    break;
+  case TOKEN_TAB: {
+    int next_tab_stop = ((cursor->x / 8) + 1) * 8;
+    if (next_tab_stop >= width)
+      handle_newline(screen, width, height);
+    else
+      cursor->x = next_tab_stop;
+    break;
+  }
+  case TOKEN_BACKSPACE:
+    if (cursor->x > 0)
+      cursor->x--;
+    break;
+  case TOKEN_SAVE_CURSOR:
+    screen->saved_cursor = *cursor;
+    break;
+  case TOKEN_RESTORE_CURSOR:
+    *cursor = screen->saved_cursor;
+    break;
+  case TOKEN_REVERSE_INDEX:
+    if (cursor->y > screen->scroll_top) {
+      cursor->y--;
+    } else if (cursor->y == screen->scroll_top) {
+      rotate_lines(screen, screen->scroll_top, screen->scroll_bot, -1);
+      clear_lines(screen, screen->scroll_top, screen->scroll_top, width,
+                  cursor->bg_attr_id);
+    } else {
+      if (cursor->y > 0)
         cursor->y--;
-      } else if (cursor->y == screen->scroll_top) {
-        for (int j = screen->scroll_bot; j > screen->scroll_top; j--)
-          memcpy(screen->lines[j].cells, screen->lines[j - 1].cells,
-                 width * sizeof(Term_Cell));
-        Term_Cell blank = {0};
-        blank.attr.bg = cursor->attr.bg;
-        for (int k = 0; k < width; k++)
-          screen->lines[screen->scroll_top].cells[k] = blank;
-      } else {
-        if (cursor->y > 0)
-          cursor->y--;
-      }
-      break;
-    case TOKEN_BEL:
-      terminal->modes.bell_pending = true;
-      break;
-    case TOKEN_OSC:
-      handle_osc(terminal, token);
-      break;
-    default: {
-      char repr[128];
-      token_repr(&token, repr, sizeof(repr));
-      LOG_WARNING_MSG("unhandled token type %d: %s", token.type, repr);
-      break;
-    }
     }
+    break;
+  case TOKEN_BEL:
+    terminal->modes.bell_pending = true;
+    break;
+  case TOKEN_OSC:
+    handle_osc(terminal, token);
+    break;
+  default: {
+    char repr[128];
+    token_repr(&token, repr, sizeof(repr));
+    LOG_WARNING_MSG("unhandled token type %d: %s", token.type, repr);
+    break;
   }
+  }
+}
+
+void write_terminal(Terminal *terminal, const char *text, int length) {
+  Term_Screen *active =
+      terminal->screens.using_alt_screen ? &terminal->screens.alt_screen : &terminal->screens.screen;
+  active->scroll_offset = 0;
 
-  free_tokens(tokens);
-  free(combined);
+  tokenize(&terminal->parser, text, length, apply_token, terminal);
 }
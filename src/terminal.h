@@ -2,6 +2,7 @@
 #define TERMINAL_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 typedef struct {
@@ -38,42 +39,173 @@ typedef struct {
   uint16_t uri_idx; // 0 = no link; >0 = 1-based index into terminal->uri_table
 } Term_Attr;
 
+#define CELL_WIDE 0x01      // left half of a double-width character
+#define CELL_WIDE_CONT 0x02 // right half placeholder (no glyph drawn here)
+#define CELL_WRAP 0x04      // last cell of a row that autowrapped to the next
+#define CELL_CLUSTER 0x10   // cp is an id in terminal->clusters
+
+// 8 bytes per cell. A character with combining marks is stored once in the
+// cluster table and the cell holds its id.
 typedef struct {
-  char data[6];
-  int length;
-  Term_Attr attr;
-  int wide;      // 1 = left half of a double-width character
-  int wide_cont; // 1 = right half placeholder (no glyph drawn here)
+  uint32_t cp;   // 21-bit code point or cluster id; 0 = empty
+  uint16_t attr; // id in terminal->attrs; 0 is the default attribute
+  uint8_t flags; // CELL_*
 } Term_Cell;
 
+// damage_x0..damage_x1 are the columns changed since the renderer last
+// cleared the damage; damage_x0 > damage_x1 when none have
 typedef struct {
   Term_Cell *cells;
+  int damage_x0;
+  int damage_x1;
 } Term_Line;
 
+// Screen-wide damage. Row damage is kept in Term_Line and moves with the row
+// when lines scroll, so a renderer that moves the pixels of rows
+// scroll_top..scroll_bot up by scroll rows (down if negative) only has to
+// redraw the damaged rows.
+typedef struct {
+  bool all; // everything must be redrawn
+  int scroll;
+  int scroll_top;
+  int scroll_bot;
+} Term_Damage;
+
 typedef struct {
   int x;
   int y;
   Term_Attr attr;
+  uint16_t attr_id;    // attr, interned
+  uint16_t bg_attr_id; // default attributes on attr's background, for erasing
 } Term_Cursor;
 
+#define SCROLLBACK_BLOCK_SIZE 65536 // bytes
+// Smallest scrollback-max-bytes. Storage is released a block at a time, so a
+// budget under two blocks would evict all but the newest line on every push.
+#define SCROLLBACK_MIN_BUDGET (2 * SCROLLBACK_BLOCK_SIZE)
+
+#define SCROLL_LINE_BYTE_CPS 0x01 // code points are stored as single bytes
+#define SCROLL_LINE_FLAGS 0x02    // a flags byte is stored for each cell
+
+typedef struct {
+  uint16_t attr;
+  uint16_t length;
+} Term_AttrRun;
+
+// A scrollback line, trimmed after the last cell that differs from a blank
+// cell with fill_attr. The header is followed by length code points, then
+// length flag bytes if SCROLL_LINE_FLAGS is set, then run_count
+// Term_AttrRuns at the next even address.
+typedef struct {
+  uint16_t length;
+  uint16_t run_count;
+  uint16_t fill_attr;
+  uint8_t format; // SCROLL_LINE_*
+} Term_ScrollLine;
+
+// Scrollback lines are packed in order into blocks of SCROLLBACK_BLOCK_SIZE
+// bytes. Eviction is oldest first, so a block is released whole once its
+// last line has left the ring. When compression is on, a block also closes
+// after SCROLLBACK_BLOCK_LINES lines, and blocks that fall more than
+// compress_after lines behind the newest are LZ-compressed.
+typedef struct Term_ScrollBlock {
+  struct Term_ScrollBlock *next; // towards newer blocks
+  uint8_t *data;                 // packed lines, NULL once compressed
+  uint8_t *lz;                   // compressed data
+  int lz_size;
+  int size;  // capacity of data in bytes
+  int used;  // bytes handed out
+  int count; // lines ever stored
+  int lines; // lines still in the ring
+} Term_ScrollBlock;
+
+#define SCROLLBACK_BLOCK_LINES 256
+#define SCROLLBACK_CACHE_BLOCKS 4
+
+typedef struct {
+  Term_ScrollBlock *block;
+  int offset; // of the packed line in the block's data
+  int width;  // terminal width when the line was pushed
+} Term_ScrollEntry;
+
+// A compressed block expanded for reading
+typedef struct {
+  const Term_ScrollBlock *block;
+  uint8_t *data;
+  int size;
+  unsigned long used; // cache clock at last use
+} Term_ScrollCache;
+
+#define SPILL_SEGMENTS 2
+#define SPILL_INDEX_STRIDE 16       // lines per index entry
+#define SPILL_RESERVE (1024 * 1024) // file space reserved at a time
+
+// A line evicted to the spill file: this header, then the packed line
 typedef struct {
-  Term_Cell **lines;
-  int *widths;
+  uint32_t size; // of the record, a multiple of 8
+  uint16_t width;
+  uint16_t unused;
+} Term_SpillRecord;
+
+// An append-only, memory-mapped file of spilled lines
+typedef struct {
+  int fd;
+  uint8_t *map;    // segment_size bytes of address space
+  size_t used;     // bytes written
+  size_t reserved; // bytes allocated in the file
+  int lines;
+  size_t *index; // offset of every SPILL_INDEX_STRIDE-th line
+  int index_capacity;
+} Term_SpillSegment;
+
+// Lines evicted from the ring, oldest segment first. When the newest segment
+// is full the oldest one is emptied and reused.
+typedef struct {
+  size_t segment_size; // 0 when spilling is off
+  bool failed;         // spilling stopped after an error
+  Term_SpillSegment segments[SPILL_SEGMENTS];
+  int segment_count;
+  int count; // lines in all segments
+} Term_Spill;
+
+typedef struct {
+  Term_ScrollEntry *lines; // ring of ring_size entries
+  int ring_size;           // grows on demand up to capacity
   int capacity;
-  int count;
+  int count; // spilled lines, then lines in the ring
   int head;
+  size_t max_bytes;  // budget for block storage, 0 for none
+  size_t bytes;      // block storage held, raw or compressed; the index,
+                     // spare and cache are outside the budget
+  size_t peak_bytes;
+  Term_ScrollBlock *oldest;
+  Term_ScrollBlock *newest;
+  Term_ScrollBlock *hot;   // oldest block not yet considered for compression
+  int hot_lines;           // lines from hot to newest
+  int compress_after;      // lines kept uncompressed, 0 to never compress
+  uint8_t *spare;          // drained block buffer kept for reuse
+  Term_ScrollCache cache[SCROLLBACK_CACHE_BLOCKS];
+  unsigned long cache_clock;
+  size_t raw_bytes;        // packed size of the blocks now compressed
+  size_t lz_bytes;         // their compressed size
+  unsigned long compressed_blocks; // blocks compressed so far
+  Term_Spill spill;
 } Term_Scrollback;
 
 typedef struct {
   Term_Cursor cursor;
   Term_Cursor saved_cursor;
-  Term_Line *lines;
+  Term_Line *lines;  // ring of rows; row y is lines[(line_base + y) % rows]
+  int line_base;
+  int line_count;
   Term_Scrollback scrollback;
   int scroll_offset;
   int scroll_top;
   int scroll_bot;
   bool cursor_hidden;
   bool scrolled;
+  bool ambiguous_wide; // East Asian ambiguous characters take two columns
+  Term_Damage damage;
 } Term_Screen;
 
 typedef struct {
@@ -97,9 +229,56 @@ typedef struct {
   int icon_name_stack_depth;
 } Term_Title;
 
+typedef enum {
+  TOKEN_TEXT,
+  TOKEN_NEWLINE,             // \n
+  TOKEN_CARRIAGE_RETURN,     // \r
+  TOKEN_CSI_CODE,            // ESC[...m ESC[..H
+  TOKEN_FULL_RESET,          // ESC c (RIS)
+  TOKEN_TAB,                 // \t
+  TOKEN_BACKSPACE,           // \b
+  TOKEN_OSC,                 // ESC ] ... BEL/ST
+  TOKEN_REVERSE_INDEX,       // ESC M
+  TOKEN_SAVE_CURSOR,         // ESC 7 (DECSC)
+  TOKEN_RESTORE_CURSOR,      // ESC 8 (DECRC)
+  TOKEN_BEL,                 // \a (0x07)
+} Term_TokenType;
+
+#define CSI_MAX_PARAMS 32
+#define CSI_MAX_INTERMEDIATES 2
+
+// A CSI sequence split into its fields. Omitted parameters are 0.
 typedef struct {
-  char partial_buf[64];
-  int partial_len;
+  char private_marker; // '<', '=', '>' or '?' right after ESC [, else 0
+  char intermediates[CSI_MAX_INTERMEDIATES];
+  int intermediate_count;
+  char final;
+  int params[CSI_MAX_PARAMS];
+  int param_count;
+  uint32_t subparams; // bit i set: params[i] follows a ':' (38:2:r:g:b)
+} Term_Csi;
+
+typedef struct {
+  Term_TokenType type;
+  const char *value; // slice of the buffer passed to write_terminal
+  int length;
+  bool ascii; // TOKEN_TEXT only: every byte is 7-bit, one cell per byte
+  const Term_Csi *csi; // TOKEN_CSI_CODE only: the parsed sequence
+} Term_Token;
+
+#define PARSER_MAX_SEQUENCE (8 * 1024 * 1024) // default osc-max-bytes
+#define PARSER_KEEP_BYTES 65536 // accumulator size kept between sequences
+
+typedef struct {
+  int state;        // DEC state machine position, carried across reads
+  char *seq_buf;    // bytes of a sequence that began in an earlier read
+  int seq_len;
+  int seq_cap;
+  bool seq_overflow; // current sequence exceeded max_sequence; skip it
+  int max_sequence;
+  char utf8_buf[4]; // leading bytes of a character split across reads
+  int utf8_len;
+  Term_Csi csi; // fields of the CSI token being dispatched
 } Term_Parser;
 
 typedef struct {
@@ -110,6 +289,8 @@ typedef struct {
                     // underline, 4=steady underline, 5=blinking bar, 6=steady bar
   bool cursor_blink; // false when ?12l disables blinking independent of cursor_shape
   bool bell_pending;
+  bool synchronized; // ?2026h: hold drawing until the update is complete
+  bool sync_begun;   // an update began since the GUI last checked
 } Term_Modes;
 
 typedef struct {
@@ -141,6 +322,40 @@ typedef struct {
   int shell_mark_head;
 } Term_Marks;
 
+#define ATTR_MAX 65535 // attribute ids are 16 bits
+
+// Interned attributes: every distinct Term_Attr in use is stored once and
+// cells refer to it by id
+typedef struct {
+  Term_Attr *attrs; // indexed by id
+  uint16_t *slots;  // open-addressed hash of id + 1; 0 = empty
+  int slot_count;   // power of two, at least twice capacity
+  uint16_t *free_ids;
+  int free_count;
+  int count; // ids handed out, including ones now on the free list
+  int capacity;
+} Term_AttrTable;
+
+#define CLUSTER_MAX 8 // code points in one cell: a base and its combining marks
+#define CLUSTER_ID_MAX 65535
+#define CELL_TEXT_MAX (CLUSTER_MAX * 4) // UTF-8 bytes of one cell
+
+typedef struct {
+  uint32_t cps[CLUSTER_MAX];
+  int count;
+} Term_Cluster;
+
+// Interned clusters, managed like the attribute table
+typedef struct {
+  Term_Cluster *clusters; // indexed by id
+  uint32_t *slots;        // open-addressed hash of id + 1; 0 = empty
+  int slot_count;
+  uint32_t *free_ids;
+  int free_count;
+  int count;
+  int capacity;
+} Term_ClusterTable;
+
 typedef struct {
   Term_Dims dims;
   Term_Screens screens;
@@ -151,46 +366,10 @@ typedef struct {
   Term_Response response;
   Term_Uri uri;
   Term_Marks marks;
+  Term_AttrTable attrs;
+  Term_ClusterTable clusters;
 } Terminal;
 
-typedef enum {
-  TOKEN_TEXT,
-  TOKEN_NEWLINE,             // \n
-  TOKEN_CARRIAGE_RETURN,     // \r
-  TOKEN_CSI_CODE,            // ESC[...m ESC[..H
-  TOKEN_ERASE_EOL,           // ESC[K ESC[0K
-  TOKEN_ERASE_SOL,           // ESC[1K
-  TOKEN_ERASE_LINE,          // ESC[2K
-  TOKEN_ERASE_DOWN,          // ESC[J ESC[0J
-  TOKEN_ERASE_UP,            // ESC[1J
-  TOKEN_ERASE_ALL,           // ESC[2J
-  TOKEN_ERASE_SCROLLBACK,    // ESC[3J
-  TOKEN_ALT_SCREEN,          // ESC[?1049h
-  TOKEN_MAIN_SCREEN,         // ESC[?1049l
-  TOKEN_CURSOR_HIDE,         // ESC[?25l
-  TOKEN_CURSOR_SHOW,         // ESC[?25h
-  TOKEN_BRACKETED_PASTE_ON,  // ESC[?2004h
-  TOKEN_BRACKETED_PASTE_OFF, // ESC[?2004l
-  TOKEN_FULL_RESET,          // ESC c (RIS)
-  TOKEN_TAB,                 // \t
-  TOKEN_BACKSPACE,           // \b or 0x7f
-  TOKEN_OSC,                 // ESC ] ... BEL/ST
-  TOKEN_REVERSE_INDEX,       // ESC M
-  TOKEN_BEL,                 // \a (0x07)
-  TOKEN_UNKNOWN,
-} Term_TokenType;
-
-typedef struct {
-  Term_TokenType type;
-  char *value;
-  int length;
-} Term_Token;
-
-typedef struct {
-  Term_Token *tokens;
-  int count;
-} Term_Tokens;
-
 void init_terminal(Terminal *terminal, int width, int height,
                    int scrollback_lines);
 
@@ -3,9 +3,140 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "log.h"
+#include "scan.h"
 #include "terminal.h"
 #include "tokenize.h"
 
+// DEC/ECMA-48 parser states, after Paul Williams' VT500 state diagram. DCS,
+// SOS, PM and APC strings share one state since none of them are acted on.
+typedef enum {
+  PARSE_GROUND,
+  PARSE_ESCAPE,
+  PARSE_ESCAPE_INTERMEDIATE,
+  PARSE_CSI_ENTRY,
+  PARSE_CSI_PARAM,
+  PARSE_CSI_INTERMEDIATE,
+  PARSE_CSI_IGNORE,
+  PARSE_OSC_STRING,
+  PARSE_DCS_STRING,
+  PARSE_STATE_COUNT,
+} Term_ParseState;
+
+typedef enum {
+  ACT_NONE,         // consume the byte as part of the current sequence
+  ACT_PRINT,        // printable text in ground state
+  ACT_EXECUTE,      // C0 control, executed immediately even mid-sequence
+  ACT_CLEAR,        // ESC: start of a new escape sequence
+  ACT_ESC_DISPATCH, // final byte of an ESC sequence
+  ACT_CSI_DISPATCH, // final byte of a CSI sequence
+  ACT_OSC_END,      // BEL terminating an OSC string
+  ACT_ABORT,        // CAN/SUB or the end of an ignored sequence
+} Term_ParseAction;
+
+#define T(action, state) (uint8_t)(((action) << 4) | (state))
+#define T_ACTION(entry) ((entry) >> 4)
+#define T_STATE(entry) ((entry)&0x0f)
+
+// C0 controls that execute from any state except the string states.
+#define C0_EXECUTE(state)                                                      \
+  [0x00 ... 0x17] = T(ACT_EXECUTE, state), [0x19] = T(ACT_EXECUTE, state),     \
+  [0x1c ... 0x1f] = T(ACT_EXECUTE, state)
+
+#define ANYWHERE                                                               \
+  [0x18] = T(ACT_ABORT, PARSE_GROUND), [0x1a] = T(ACT_ABORT, PARSE_GROUND),    \
+  [0x1b] = T(ACT_CLEAR, PARSE_ESCAPE)
+
+// Later designators deliberately override the ranges before them.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"
+static const uint8_t parse_table[PARSE_STATE_COUNT][256] = {
+    [PARSE_GROUND] =
+        {
+            C0_EXECUTE(PARSE_GROUND),
+            ANYWHERE,
+            [0x20 ... 0x7e] = T(ACT_PRINT, PARSE_GROUND),
+            [0x7f] = T(ACT_NONE, PARSE_GROUND),
+            [0x80 ... 0xff] = T(ACT_PRINT, PARSE_GROUND), // UTF-8
+        },
+    [PARSE_ESCAPE] =
+        {
+            C0_EXECUTE(PARSE_ESCAPE),
+            ANYWHERE,
+            [0x20 ... 0x2f] = T(ACT_NONE, PARSE_ESCAPE_INTERMEDIATE),
+            [0x30 ... 0x7e] = T(ACT_ESC_DISPATCH, PARSE_GROUND),
+            ['['] = T(ACT_NONE, PARSE_CSI_ENTRY),
+            [']'] = T(ACT_NONE, PARSE_OSC_STRING),
+            ['P'] = T(ACT_NONE, PARSE_DCS_STRING),
+            ['X'] = T(ACT_NONE, PARSE_DCS_STRING),
+            ['^'] = T(ACT_NONE, PARSE_DCS_STRING),
+            ['_'] = T(ACT_NONE, PARSE_DCS_STRING),
+            [0x7f] = T(ACT_NONE, PARSE_ESCAPE),
+            [0x80 ... 0xff] = T(ACT_ABORT, PARSE_GROUND),
+        },
+    [PARSE_ESCAPE_INTERMEDIATE] =
+        {
+            C0_EXECUTE(PARSE_ESCAPE_INTERMEDIATE),
+            ANYWHERE,
+            [0x20 ... 0x2f] = T(ACT_NONE, PARSE_ESCAPE_INTERMEDIATE),
+            [0x30 ... 0x7e] = T(ACT_ESC_DISPATCH, PARSE_GROUND),
+            [0x7f] = T(ACT_NONE, PARSE_ESCAPE_INTERMEDIATE),
+            [0x80 ... 0xff] = T(ACT_ABORT, PARSE_GROUND),
+        },
+    [PARSE_CSI_ENTRY] =
+        {
+            C0_EXECUTE(PARSE_CSI_ENTRY),
+            ANYWHERE,
+            [0x20 ... 0x2f] = T(ACT_NONE, PARSE_CSI_INTERMEDIATE),
+            [0x30 ... 0x3f] = T(ACT_NONE, PARSE_CSI_PARAM),
+            [0x40 ... 0x7e] = T(ACT_CSI_DISPATCH, PARSE_GROUND),
+            [0x7f] = T(ACT_NONE, PARSE_CSI_ENTRY),
+            [0x80 ... 0xff] = T(ACT_ABORT, PARSE_GROUND),
+        },
+    [PARSE_CSI_PARAM] =
+        {
+            C0_EXECUTE(PARSE_CSI_PARAM),
+            ANYWHERE,
+            [0x20 ... 0x2f] = T(ACT_NONE, PARSE_CSI_INTERMEDIATE),
+            [0x30 ... 0x3b] = T(ACT_NONE, PARSE_CSI_PARAM),
+            [0x3c ... 0x3f] = T(ACT_NONE, PARSE_CSI_IGNORE),
+            [0x40 ... 0x7e] = T(ACT_CSI_DISPATCH, PARSE_GROUND),
+            [0x7f] = T(ACT_NONE, PARSE_CSI_PARAM),
+            [0x80 ... 0xff] = T(ACT_ABORT, PARSE_GROUND),
+        },
+    [PARSE_CSI_INTERMEDIATE] =
+        {
+            C0_EXECUTE(PARSE_CSI_INTERMEDIATE),
+            ANYWHERE,
+            [0x20 ... 0x2f] = T(ACT_NONE, PARSE_CSI_INTERMEDIATE),
+            [0x30 ... 0x3f] = T(ACT_NONE, PARSE_CSI_IGNORE),
+            [0x40 ... 0x7e] = T(ACT_CSI_DISPATCH, PARSE_GROUND),
+            [0x7f] = T(ACT_NONE, PARSE_CSI_INTERMEDIATE),
+            [0x80 ... 0xff] = T(ACT_ABORT, PARSE_GROUND),
+        },
+    [PARSE_CSI_IGNORE] =
+        {
+            C0_EXECUTE(PARSE_CSI_IGNORE),
+            ANYWHERE,
+            [0x20 ... 0x3f] = T(ACT_NONE, PARSE_CSI_IGNORE),
+            [0x40 ... 0x7e] = T(ACT_ABORT, PARSE_GROUND),
+            [0x7f] = T(ACT_NONE, PARSE_CSI_IGNORE),
+            [0x80 ... 0xff] = T(ACT_ABORT, PARSE_GROUND),
+        },
+    [PARSE_OSC_STRING] =
+        {
+            [0x00 ... 0xff] = T(ACT_NONE, PARSE_OSC_STRING),
+            ANYWHERE,
+            [0x07] = T(ACT_OSC_END, PARSE_GROUND),
+        },
+    [PARSE_DCS_STRING] =
+        {
+            [0x00 ... 0xff] = T(ACT_NONE, PARSE_DCS_STRING),
+            ANYWHERE,
+        },
+};
+#pragma GCC diagnostic pop
+
 void token_repr(const Term_Token *t, char *buf, int bufsize) {
   int out = 0;
   for (int i = 0; i < t->length && out < bufsize - 4; i++) {
@@ -21,215 +152,276 @@ void token_repr(const Term_Token *t, char *buf, int bufsize) {
   buf[out] = '\0';
 }
 
-bool add_token(Term_Tokens *tokens, Term_TokenType type, const char *value,
-               int start_index, int length) {
-  if (tokens->count % 128 == 0) {
-    Term_Token *new_tokens = (Term_Token *)realloc(
-        tokens->tokens, (tokens->count + 128) * sizeof(Term_Token));
-    if (!new_tokens)
-      return false;
-    tokens->tokens = new_tokens;
+static int utf8_char_len(unsigned char lead) {
+  if ((lead & 0xe0) == 0xc0)
+    return 2;
+  if ((lead & 0xf0) == 0xe0)
+    return 3;
+  if ((lead & 0xf8) == 0xf0)
+    return 4;
+  return 1;
+}
+
+static int incomplete_utf8_len(const char *buf, int len) {
+  int i = len - 1;
+  while (i >= 0 && i > len - 4 && ((unsigned char)buf[i] & 0xc0) == 0x80)
+    i--;
+  if (i < 0)
+    return 0;
+
+  int have = len - i;
+  return have < utf8_char_len((unsigned char)buf[i]) ? have : 0;
+}
+
+static void execute_control(const char *c, Term_TokenHandler handler,
+                            void *ctx) {
+  Term_TokenType type;
+  switch (*c) {
+  case '\n':
+    type = TOKEN_NEWLINE;
+    break;
+  case '\r':
+    type = TOKEN_CARRIAGE_RETURN;
+    break;
+  case '\b':
+    type = TOKEN_BACKSPACE;
+    break;
+  case '\t':
+    type = TOKEN_TAB;
+    break;
+  case '\a':
+    type = TOKEN_BEL;
+    break;
+  default:
+    return; // SO, SI, VT, FF and friends are ignored
   }
-  char *buf = malloc(length + 1);
-  if (!buf)
-    return false;
-  memcpy(buf, &value[start_index], length);
-  buf[length] = '\0';
-  Term_Token *token = &tokens->tokens[tokens->count++];
-  token->type = type;
-  token->length = length;
-  token->value = buf;
-  return true;
+  handler(ctx, (Term_Token){type, c, 1, false, NULL});
 }
 
-bool is_csi_code(const char *text, int length, int index, int *code_length) {
-  if (index + 2 < length && text[index] == '\x1b' && text[index + 1] == '[') {
-    int i = index + 2;
-    while (i < length && (unsigned char)text[i] >= 0x30 &&
-           (unsigned char)text[i] <= 0x3f) {
-      i++;
-    }
-    while (i < length && (unsigned char)text[i] >= 0x20 &&
-           (unsigned char)text[i] <= 0x2f) {
-      i++;
-    }
-    if (i < length && (unsigned char)text[i] >= 0x40 &&
-        (unsigned char)text[i] <= 0x7e) {
-      *code_length = i - index + 1;
-      return true;
-    }
+static void esc_dispatch(const char *seq, int length, Term_TokenHandler handler,
+                         void *ctx) {
+  if (length != 2)
+    return; // charset designations (ESC ( B) and the like are ignored
+  Term_TokenType type;
+  switch (seq[1]) {
+  case '7':
+    type = TOKEN_SAVE_CURSOR;
+    break;
+  case '8':
+    type = TOKEN_RESTORE_CURSOR;
+    break;
+  case 'M':
+    type = TOKEN_REVERSE_INDEX;
+    break;
+  case 'c':
+    type = TOKEN_FULL_RESET;
+    break;
+  default:
+    return; // keypad modes, ST and unsupported finals
   }
-  return false;
+  handler(ctx, (Term_Token){type, seq, length, false, NULL});
 }
 
-bool is_osc_sequence(const char *text, int length, int index, int *seq_length) {
-  if (index + 2 >= length || text[index] != '\x1b' || text[index + 1] != ']')
-    return false;
-  for (int i = index + 2; i < length; i++) {
-    if ((unsigned char)text[i] == 0x07) {
-      *seq_length = i - index + 1;
-      return true;
-    }
-    if (i + 1 < length && text[i] == '\x1b' && text[i + 1] == '\\') {
-      *seq_length = i - index + 2;
-      return true;
+// Splits a complete CSI sequence, ESC [ through the final byte, into its
+// private marker, parameters, intermediates and final byte
+static void csi_parse(const char *seq, int length, Term_Csi *csi) {
+  csi->private_marker = 0;
+  csi->intermediate_count = 0;
+  csi->final = seq[length - 1];
+  csi->param_count = 0;
+  csi->subparams = 0;
+
+  int i = 2;
+  if (i < length - 1 && seq[i] >= '<' && seq[i] <= '?')
+    csi->private_marker = seq[i++];
+
+  int value = 0;
+  bool pending = false;
+  for (; i < length - 1; i++) {
+    char c = seq[i];
+    if (c >= '0' && c <= '9') {
+      value = value * 10 + (c - '0');
+      if (value > 65535)
+        value = 65535;
+      pending = true;
+    } else if (c == ';' || c == ':') {
+      if (csi->param_count < CSI_MAX_PARAMS)
+        csi->params[csi->param_count++] = value;
+      if (c == ':' && csi->param_count < CSI_MAX_PARAMS)
+        csi->subparams |= 1u << csi->param_count;
+      value = 0;
+      pending = true;
+    } else if (c >= 0x20 && c <= 0x2f &&
+               csi->intermediate_count < CSI_MAX_INTERMEDIATES) {
+      csi->intermediates[csi->intermediate_count++] = c;
     }
   }
-  return false;
+  if (pending && csi->param_count < CSI_MAX_PARAMS)
+    csi->params[csi->param_count++] = value;
 }
 
-bool matches(const char *text, int length, int index, const char *pattern,
-             int *pattern_length) {
-  int pat_len = strlen(pattern);
-  if (index + pat_len <= length &&
-      strncmp(&text[index], pattern, pat_len) == 0) {
-    *pattern_length = pat_len;
-    return true;
+// Appends part of a sequence that straddles a read to the accumulator. Once a
+// sequence outgrows max_sequence it is dropped and the rest of it is skipped.
+static void sequence_append(Term_Parser *parser, const char *data, int len) {
+  if (parser->seq_overflow || len == 0)
+    return;
+  if (parser->seq_len + len > parser->max_sequence) {
+    LOG_WARNING_MSG("discarding escape sequence longer than %d bytes",
+                    parser->max_sequence);
+    parser->seq_overflow = true;
+    parser->seq_len = 0;
+    return;
   }
-  return false;
+  if (parser->seq_len + len > parser->seq_cap) {
+    int cap = parser->seq_cap ? parser->seq_cap * 2 : 256;
+    while (cap < parser->seq_len + len)
+      cap *= 2;
+    char *buf = realloc(parser->seq_buf, cap);
+    if (!buf) {
+      parser->seq_overflow = true;
+      parser->seq_len = 0;
+      return;
+    }
+    parser->seq_buf = buf;
+    parser->seq_cap = cap;
+  }
+  memcpy(parser->seq_buf + parser->seq_len, data, len);
+  parser->seq_len += len;
 }
 
-bool starts_with(const char *str, int length, const char *prefix) {
-  int prefix_len = strlen(prefix);
-  if (length < prefix_len) {
-    return false;
+static void sequence_reset(Term_Parser *parser) {
+  parser->seq_len = 0;
+  parser->seq_overflow = false;
+  // Don't hold on to the memory of a one-off multi-megabyte OSC 52
+  if (parser->seq_cap > PARSER_KEEP_BYTES) {
+    free(parser->seq_buf);
+    parser->seq_buf = NULL;
+    parser->seq_cap = 0;
   }
-  return strncmp(str, prefix, prefix_len) == 0;
 }
 
-bool ends_with(const char *str, int length, char suffix) {
-  if (length < 1) {
+// Resolves the sequence ending at text + end to one contiguous slice: either
+// the read buffer itself or, when it began in an earlier read, the accumulator.
+static bool sequence_slice(Term_Parser *parser, const char *text, int start,
+                           int end, const char **seq, int *len) {
+  if (parser->seq_len > 0 || parser->seq_overflow) {
+    sequence_append(parser, text + start, end - start);
+    if (parser->seq_overflow)
+      return false;
+    *seq = parser->seq_buf;
+    *len = parser->seq_len;
+    return true;
+  }
+  if (end - start > parser->max_sequence) {
+    LOG_WARNING_MSG("discarding escape sequence longer than %d bytes",
+                    parser->max_sequence);
     return false;
   }
-  return str[length - 1] == suffix;
+  *seq = text + start;
+  *len = end - start;
+  return true;
 }
 
-Term_Tokens *tokenize(const char *text, int length) {
-  Term_Tokens *tokens = (Term_Tokens *)malloc(sizeof(Term_Tokens));
-  if (!tokens)
-    return NULL;
-  tokens->tokens = (Term_Token *)malloc(128 * sizeof(Term_Token));
-  if (!tokens->tokens) {
-    free(tokens);
-    return NULL;
+static bool accumulates(int state) {
+  return state != PARSE_GROUND && state != PARSE_CSI_IGNORE &&
+         state != PARSE_DCS_STRING;
+}
+
+void tokenize(Term_Parser *parser, const char *text, int length,
+              Term_TokenHandler handler, void *ctx) {
+  int i = 0;
+
+  if (parser->utf8_len > 0) {
+    int need = utf8_char_len((unsigned char)parser->utf8_buf[0]);
+    while (parser->utf8_len < need && i < length &&
+           ((unsigned char)text[i] & 0xc0) == 0x80)
+      parser->utf8_buf[parser->utf8_len++] = text[i++];
+    if (parser->utf8_len < need && i == length)
+      return;
+    handler(ctx, (Term_Token){TOKEN_TEXT, parser->utf8_buf, parser->utf8_len,
+                              false, NULL});
+    parser->utf8_len = 0;
   }
-  tokens->count = 0;
-  bool ok = true;
-
-  for (int i = 0; i < length; i++) {
-    int len = 0;
-    if (is_osc_sequence(text, length, i, &len)) {
-      ok = ok && add_token(tokens, TOKEN_OSC, text, i, len);
-    } else if (is_csi_code(text, length, i, &len)) {
-      ok = ok && add_token(tokens, TOKEN_CSI_CODE, text, i, len);
-    } else if (matches(text, length, i, "\n", &len)) {
-      ok = ok && add_token(tokens, TOKEN_NEWLINE, text, i, len);
-    } else if (matches(text, length, i, "\r", &len)) {
-      ok = ok && add_token(tokens, TOKEN_CARRIAGE_RETURN, text, i, len);
-    } else if (matches(text, length, i, "\b", &len) ||
-               (i < length && (unsigned char)text[i] == 0x7f)) {
-      ok = ok && add_token(tokens, TOKEN_BACKSPACE, text, i, 1);
-    } else if (matches(text, length, i, "\x1b[J", &len)) {
-      ok = ok && add_token(tokens, TOKEN_ERASE_DOWN, text, i, len);
-    } else if (matches(text, length, i, "\x1b[0J", &len)) {
-      ok = ok && add_token(tokens, TOKEN_ERASE_DOWN, text, i, len);
-    } else if (matches(text, length, i, "\x1b[1J", &len)) {
-      ok = ok && add_token(tokens, TOKEN_ERASE_UP, text, i, len);
-    } else if (matches(text, length, i, "\x1b[2J", &len)) {
-      ok = ok && add_token(tokens, TOKEN_ERASE_ALL, text, i, len);
-    } else if (matches(text, length, i, "\x1b[3J", &len)) {
-      ok = ok && add_token(tokens, TOKEN_ERASE_SCROLLBACK, text, i, len);
-    } else if (matches(text, length, i, "\x1b[K", &len)) {
-      ok = ok && add_token(tokens, TOKEN_ERASE_EOL, text, i, len);
-    } else if (matches(text, length, i, "\x1b[0K", &len)) {
-      ok = ok && add_token(tokens, TOKEN_ERASE_EOL, text, i, len);
-    } else if (matches(text, length, i, "\x1b[1K", &len)) {
-      ok = ok && add_token(tokens, TOKEN_ERASE_SOL, text, i, len);
-    } else if (matches(text, length, i, "\x1b[2K", &len)) {
-      ok = ok && add_token(tokens, TOKEN_ERASE_LINE, text, i, len);
-    } else if (matches(text, length, i, "\x1b[?1049h", &len)) {
-      ok = ok && add_token(tokens, TOKEN_ALT_SCREEN, text, i, len);
-    } else if (matches(text, length, i, "\x1b[?1049l", &len)) {
-      ok = ok && add_token(tokens, TOKEN_MAIN_SCREEN, text, i, len);
-    } else if (matches(text, length, i, "\x1b[?25l", &len)) {
-      ok = ok && add_token(tokens, TOKEN_CURSOR_HIDE, text, i, len);
-    } else if (matches(text, length, i, "\x1b[?25h", &len)) {
-      ok = ok && add_token(tokens, TOKEN_CURSOR_SHOW, text, i, len);
-    } else if (matches(text, length, i, "\x1b[?2004h", &len)) {
-      ok = ok && add_token(tokens, TOKEN_BRACKETED_PASTE_ON, text, i, len);
-    } else if (matches(text, length, i, "\x1b[?2004l", &len)) {
-      ok = ok && add_token(tokens, TOKEN_BRACKETED_PASTE_OFF, text, i, len);
-    } else if (matches(text, length, i,
-                       "\x1b"
-                       "7",
-                       &len)) {
-      ok = ok && add_token(tokens, TOKEN_CSI_CODE, text, i, len);
-    } else if (matches(text, length, i,
-                       "\x1b"
-                       "8",
-                       &len)) {
-      ok = ok && add_token(tokens, TOKEN_CSI_CODE, text, i, len);
-    } else if (matches(text, length, i,
-                       "\x1b"
-                       "M",
-                       &len)) {
-      ok = ok && add_token(tokens, TOKEN_REVERSE_INDEX, text, i, len);
-    } else if (matches(text, length, i,
-                       "\x1b"
-                       "c",
-                       &len)) {
-      ok = ok && add_token(tokens, TOKEN_FULL_RESET, text, i, len);
-    } else if (i + 1 < length && text[i] == '\x1b' &&
-               (text[i + 1] == '=' || text[i + 1] == '>')) {
-      len = 2; // application/normal keypad mode
-    } else if (i + 2 < length && text[i] == '\x1b' &&
-               (text[i + 1] == '(' || text[i + 1] == ')' ||
-                text[i + 1] == '*' || text[i + 1] == '+')) {
-      len = 3; // character set designation (e.g., \x1b(B)
-    } else if (is_osc_sequence(text, length, i, &len)) {
-      ok = ok && add_token(tokens, TOKEN_OSC, text, i, len);
-    } else if (is_csi_code(text, length, i, &len)) {
-      ok = ok && add_token(tokens, TOKEN_CSI_CODE, text, i, len);
-    } else if (matches(text, length, i, "\t", &len)) {
-      ok = ok && add_token(tokens, TOKEN_TAB, text, i, len);
-    } else if (text[i] == '\x07') {
-      ok = ok && add_token(tokens, TOKEN_BEL, text, i, 1);
-      len = 1;
-    } else {
+
+  int state = parser->state;
+  int seq_start = i; // a sequence carried over from the last read starts here
+
+  for (; i < length; i++) {
+    if (state == PARSE_GROUND) {
       int start = i;
-      while (i < length) {
-        unsigned char c = (unsigned char)text[i];
-        if (c >= 0x20 && c < 0x7f) {
-          i++;
-        } else if (c >= 0x80) {
-          i++; // multi-byte UTF-8 lead or continuation byte
-        } else {
-          break;
-        }
+      bool ascii;
+      i += scan_text(text + i, length - i, &ascii);
+      if (i >= length) {
+        int tail = ascii ? 0 : incomplete_utf8_len(text + start, i - start);
+        if (i - tail > start)
+          handler(ctx, (Term_Token){TOKEN_TEXT, text + start, i - tail - start,
+                                    ascii, NULL});
+        memcpy(parser->utf8_buf, text + i - tail, tail);
+        parser->utf8_len = tail;
+        break;
       }
-      len = i - start;
-      if (len > 0) {
-        add_token(tokens, TOKEN_TEXT, text, start, len);
-      } else {
-        len = 1; // skip unrecognised byte; prevent i from decrementing
+      if (i > start)
+        handler(ctx, (Term_Token){TOKEN_TEXT, text + start, i - start, ascii,
+                                  NULL});
+    } else if (state == PARSE_OSC_STRING || state == PARSE_DCS_STRING) {
+      i += scan_string(text + i, length - i);
+      if (i >= length)
+        break;
+    }
+
+    uint8_t entry = parse_table[state][(unsigned char)text[i]];
+    int next = T_STATE(entry);
+    const char *seq;
+    int len;
+
+    switch (T_ACTION(entry)) {
+    case ACT_EXECUTE:
+      execute_control(&text[i], handler, ctx);
+      break;
+    case ACT_CLEAR:
+      if (state == PARSE_OSC_STRING &&
+          sequence_slice(parser, text, seq_start, i, &seq, &len))
+        handler(ctx, (Term_Token){TOKEN_OSC, seq, len, false, NULL});
+      sequence_reset(parser);
+      seq_start = i;
+      break;
+    case ACT_ESC_DISPATCH:
+      if (sequence_slice(parser, text, seq_start, i + 1, &seq, &len))
+        esc_dispatch(seq, len, handler, ctx);
+      sequence_reset(parser);
+      break;
+    case ACT_CSI_DISPATCH:
+      if (sequence_slice(parser, text, seq_start, i + 1, &seq, &len)) {
+        csi_parse(seq, len, &parser->csi);
+        handler(ctx,
+                (Term_Token){TOKEN_CSI_CODE, seq, len, false, &parser->csi});
       }
-      i = start;
+      sequence_reset(parser);
+      break;
+    case ACT_OSC_END:
+      if (sequence_slice(parser, text, seq_start, i + 1, &seq, &len))
+        handler(ctx, (Term_Token){TOKEN_OSC, seq, len, false, NULL});
+      sequence_reset(parser);
+      break;
+    case ACT_ABORT:
+      sequence_reset(parser);
+      break;
+    default:
+      break;
     }
-    i += len - 1;
+    state = next;
   }
 
-  if (!ok) {
-    free_tokens(tokens);
-    return NULL;
-  }
-  return tokens;
+  if (accumulates(state))
+    sequence_append(parser, text + seq_start, length - seq_start);
+  parser->state = state;
 }
 
-void free_tokens(Term_Tokens *tokens) {
-  for (int i = 0; i < tokens->count; i++)
-    free(tokens->tokens[i].value);
-  free(tokens->tokens);
-  free(tokens);
+void free_parser(Term_Parser *parser) {
+  free(parser->seq_buf);
+  parser->seq_buf = NULL;
+  parser->seq_cap = 0;
+  parser->seq_len = 0;
 }
 
 void print_token(Term_Token t) {
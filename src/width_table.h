@@ -0,0 +1,24 @@
+#ifndef WIDTH_TABLE_H
+#define WIDTH_TABLE_H
+
+#include <stdint.h>
+
+// Display width class of a code point; see scripts/gen_width_table.py
+typedef enum {
+  WIDTH_ZERO,      // combining or format character, joins the previous cell
+  WIDTH_NARROW,
+  WIDTH_WIDE,
+  WIDTH_AMBIGUOUS, // East Asian ambiguous, narrow unless configured otherwise
+} Term_WidthClass;
+
+extern const uint8_t width_stage1[0x110000 / 256];
+extern const uint8_t width_stage2[][64];
+
+static inline Term_WidthClass width_class(int cp) {
+  if (cp < 0 || cp >= 0x110000)
+    return WIDTH_NARROW;
+  uint8_t bits = width_stage2[width_stage1[cp >> 8]][(cp & 0xff) >> 2];
+  return (Term_WidthClass)((bits >> ((cp & 3) * 2)) & 3);
+}
+
+#endif
@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lz.h"
+
+// Round-trips blocks of random, repetitive and scrollback-like data through
+// lz_compress() and lz_decompress(), and checks that a too-small buffer or
+// damaged input is refused rather than overrun
+
+#define MAX_LEN 65536
+#define GUARD 64
+
+static int failures;
+
+static void fail(const char *kind, int len, const char *what) {
+  fprintf(stderr, "lz_check: %s, %d bytes: %s\n", kind, len, what);
+  failures++;
+}
+
+// Fills a guard zone past the end of a buffer and checks it is untouched
+static void set_guard(uint8_t *p) { memset(p, 0xa5, GUARD); }
+
+static int guard_intact(const uint8_t *p) {
+  for (int i = 0; i < GUARD; i++)
+    if (p[i] != 0xa5)
+      return 0;
+  return 1;
+}
+
+static void round_trip(const char *kind, const uint8_t *src, int len) {
+  int cap = len * 2 + 16;
+  uint8_t *lz = malloc(cap + GUARD);
+  uint8_t *out = malloc(len + GUARD);
+  set_guard(lz + cap);
+  int size = lz_compress(src, len, lz, cap);
+  if (size <= 0 || size > cap || !guard_intact(lz + cap)) {
+    fail(kind, len, "compress");
+    goto done;
+  }
+
+  set_guard(out + len);
+  if (lz_decompress(lz, size, out, len) != len || memcmp(src, out, len) ||
+      !guard_intact(out + len))
+    fail(kind, len, "round trip");
+
+  // A buffer one byte short must be refused, not overrun
+  if (len > 0) {
+    set_guard(out + len - 1);
+    if (lz_decompress(lz, size, out, len - 1) != -1 ||
+        !guard_intact(out + len - 1))
+      fail(kind, len, "short output buffer");
+  }
+
+  // As must any truncation of the compressed data
+  for (int cut = 1; cut < size && cut < 32; cut++) {
+    set_guard(out + len);
+    int n = lz_decompress(lz, size - cut, out, len);
+    if (n > len || !guard_intact(out + len))
+      fail(kind, len, "truncated input");
+  }
+
+  // And flipped bytes, which may decode to anything within the buffer
+  for (int i = 0; i < 32 && size > 0; i++) {
+    int at = rand() % size;
+    uint8_t saved = lz[at];
+    lz[at] ^= 1 + rand() % 255;
+    set_guard(out + len);
+    int n = lz_decompress(lz, size, out, len);
+    if (n > len || !guard_intact(out + len))
+      fail(kind, len, "corrupt input");
+    lz[at] = saved;
+  }
+
+  // Compressing into too little room reports failure instead of overrunning
+  if (size > 1) {
+    set_guard(lz + size - 1);
+    if (lz_compress(src, len, lz, size - 1) != 0 ||
+        !guard_intact(lz + size - 1))
+      fail(kind, len, "short compress buffer");
+  }
+
+done:
+  free(lz);
+  free(out);
+}
+
+int main(void) {
+  static const int lengths[] = {0, 1, 3, 4, 5, 15, 16, 17, 255, 256, 4096,
+                                65535, MAX_LEN};
+  uint8_t *src = malloc(MAX_LEN);
+  srand(1);
+
+  for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+    int len = lengths[l];
+
+    for (int i = 0; i < len; i++)
+      src[i] = rand();
+    round_trip("random", src, len);
+
+    for (int i = 0; i < len; i++)
+      src[i] = 'x';
+    round_trip("one byte", src, len);
+
+    for (int i = 0; i < len; i++)
+      src[i] = "abcdefg"[i % 7];
+    round_trip("period 7", src, len);
+
+    // Packed scrollback lines: a header, mostly-ASCII text, attribute runs
+    for (int i = 0; i < len; i++)
+      src[i] = i % 96 < 8 ? i % 96 : i % 96 < 80 ? 'a' + rand() % 8 : 0;
+    round_trip("line-like", src, len);
+
+    // A compressible head and a long tail that never matches, so the skip
+    // step has grown large by the time it reaches the end
+    for (int i = 0; i < len; i++)
+      src[i] = i < len / 8 ? 'x' : rand();
+    round_trip("incompressible tail", src, len);
+  }
+
+  free(src);
+  if (failures) {
+    fprintf(stderr, "lz_check: %d failures\n", failures);
+    return 1;
+  }
+  printf("lz_check: ok\n");
+  return 0;
+}